@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,170 +8,1359 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <termios.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <time.h>
 #define MAX_LEN 512
-#define MAXARGS 10
 #define ARGLEN 30
 #define PROMPT "ShellOfHasaan:- "
-#define MAX_HISTORY 10
+#define PROMPT_MORE "> "        // Prompt for the rest of an unfinished command
+#define DEFAULT_HISTSIZE 1000
+#define HIST_POOL_INIT 4096
+#define HIST_CHECKPOINT_BYTES (1 << 20)
+#define SEARCH_CANDIDATES 512
+#define SEARCH_RESULTS 64
 #define MAX_ALIASES 10
-#define MAX_VARS 100
+#define VARS_INIT_SIZE 64
+#define BUILTIN_SLOTS 64        // Size of the builtin lookup table, a power of two
+#define BUILTIN_PIPELINE 1      // May run as a pipeline stage, in a child process
+#define BUILTIN_SUBSHELL 2      // Acts the same in a subshell, so a substitution may run it in-process
+#define BUILTIN_STATE 4         // Changes shell state: a substitution never runs it in-process
+#define BUILTIN_STDIN 8         // Reads standard input, so it always runs in a child
+#define OUT_BUF_SIZE 4096
+#define TEE_CHUNK (1 << 20)     // Most bytes tee moves per splice/tee call
+#define ARG_HEADROOM 2048       // Bytes of ARG_MAX batch leaves unused, as POSIX asks of xargs
+#define ARG_STRLEN_MAX (32 * 4096)  // Linux MAX_ARG_STRLEN: longest single argument execve takes
+#define SPAWN_POSIX 0
+#define SPAWN_FORK 1
+#define HASH_INIT_SIZE 64
+#define ARENA_BLOCK_SIZE 8192
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)  // Size arena_alloc() really takes for n bytes
+#define PARSE_CACHE_SLOTS 1024          // Hash slots of the parse cache, a power of two
+#define PARSE_CACHE_BYTES (1 << 20)     // Most memory cached trees may hold between lines
+#define ARITH_DEPTH_MAX 32      // Variables whose values are evaluated as expressions, nested
+#define PARSE_MORE -1           // parse_line() status: the command goes on past the input given
+#define READ_CHUNK 65536
+#define EXPAND_CHARS "'\"\\$`"   // A word without any of these expands to itself
+#define EVENT_BATCH 64          // Most epoll events handled per wakeup
 
 typedef struct {
-    char *str;
-    int global;
+    char* name;       // NULL for an empty slot
+    char* value;
+    size_t value_cap; // Bytes available at value, so shorter values are stored in place
+    int global;       // Set by export
+    long num;         // value as an integer, for arithmetic, when has_num is set
+    int has_num;
 } Var;
 
+// Shell variables: open addressing with linear probing, keyed by name
+typedef struct {
+    Var* slots;
+    int size;    // Always a power of two
+    int count;
+} VarTable;
+
 typedef struct {
     char name[ARGLEN];
     char command[MAX_LEN];
 } Alias;
 
-int execute(char* cmd[], char* history[], int* history_count, Alias aliases[], int* alias_count, Var vars[], int* var_count);
-char** tokenize(char* cmdline);
-char* read_cmd(char*, FILE*);
-void add_to_history(char* cmd, char* history[], int* history_count);
+typedef struct {
+    char* name;   // Command name as typed, NULL for an empty slot
+    char* path;   // Absolute path it resolved to
+    int hits;
+} HashEntry;
+
+typedef struct {
+    size_t offset;   // Start of the entry's text in the pool
+    size_t len;      // Text length, not counting the terminating NUL
+} HistEntry;
+
+// Posting list of the events whose text contains one trigram, oldest first
+typedef struct {
+    uint32_t key;        // The three bytes of the trigram, 0 for an empty slot
+    uint32_t start;      // Entries before start refer to dropped events
+    uint32_t len;
+    uint32_t cap;
+    uint32_t* events;
+} Posting;
+
+// How often a command text occurs among the retained events
+typedef struct {
+    unsigned long hash;  // hash_str() of the text, 0 for an empty slot
+    uint32_t count;
+    uint32_t last;       // Newest event with this text
+} CmdFreq;
+
+// Command history: a ring of the last `capacity` commands whose text lives in one circular
+// string pool. Events are numbered from 1 and keep their number while they are retained.
+typedef struct {
+    HistEntry* entries;  // Event e lives at entries[e % capacity]
+    long capacity;
+    long first;          // Oldest event still held
+    long next;           // Number the next event will get
+    char* pool;
+    size_t pool_size;
+    size_t pool_head;    // Where the next entry's text goes
+    // Shared on-disk log, fd is -1 when history is not persisted
+    int fd;
+    char* file_path;
+    off_t file_end;      // Everything before this offset has been read
+    long file_records;   // Number of records before file_end
+    char tag[32];        // "<pid>.<start ns>\t" prefix marking this session's records
+    // Search index, updated as events are added: trigram -> events, text -> frequency
+    Posting* grams;
+    long grams_size;
+    long grams_count;
+    CmdFreq* freq;
+    long freq_size;
+    long freq_used;
+} History;
+
+// Bump allocator for everything that lives only as long as one command line
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* first;
+    ArenaBlock* cur;
+    size_t used;     // Bytes used in the current block
+    size_t total;    // Bytes handed out since the last reset
+    size_t peak;     // Largest total seen for a single command line
+} Arena;
+
+// A point in an arena to go back to, releasing everything allocated after it
+typedef struct {
+    ArenaBlock* cur;
+    size_t used;
+    size_t total;
+} ArenaMark;
+
+// String built up in an arena when its final length is not known in advance; always
+// NUL-terminated, and moved to a block twice the size when it outgrows its own
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    Arena* arena;
+} StrBuf;
+
+// Buffered line reader over a file descriptor; lines may be any length
+typedef struct {
+    int fd;
+    char* buf;
+    size_t cap;
+    size_t start;    // First byte not yet returned
+    size_t end;      // End of the bytes read so far
+    int eof;
+} LineReader;
+
+// Shell state the builtins operate on
+typedef struct {
+    History* history;
+    Alias* aliases;
+    int* alias_count;
+    VarTable* vars;
+} Shell;
+
+// Output of a builtin: buffered and written straight to fd, never through stdio, or
+// collected in sink when its output is being substituted
+typedef struct {
+    int fd;
+    int error;   // errno of the first failed write; later output is dropped
+    StrBuf* sink;
+    size_t len;
+    char buf[OUT_BUF_SIZE];
+} Out;
+
+// A builtin command: handler returning the exit status, plus BUILTIN_* flags
+typedef struct {
+    const char* name;
+    int (*run)(char* argv[], Shell* sh, Out* out);
+    int flags;
+    const char* usage;   // Shown by help
+} Builtin;
+
+// Tokens of the command language
+enum {
+    TOK_WORD,
+    TOK_PIPE,     // |
+    TOK_OR_IF,    // ||
+    TOK_AMP,      // &
+    TOK_AND_IF,   // &&
+    TOK_SEMI,     // ;
+    TOK_LPAREN,   // (
+    TOK_RPAREN,   // )
+    TOK_LESS,     // <
+    TOK_GREAT,    // >
+    TOK_DGREAT,   // >>
+    TOK_NEWLINE,  // Between the lines of a command that goes on over several
+    TOK_END       // End of the input
+};
+
+// Reserved words. lex() tells which one an unquoted word spells; they only count where the
+// grammar looks for one. From KW_RBRACE on they end a list where a command would start.
+enum {
+    KW_NONE,
+    KW_LBRACE, KW_BANG, KW_IF, KW_WHILE, KW_UNTIL, KW_FOR, KW_IN,
+    KW_RBRACE, KW_THEN, KW_ELIF, KW_ELSE, KW_FI, KW_DO, KW_DONE,
+    KW_COUNT
+};
+
+// Command tree node types
+enum {
+    NODE_CMD,       // Simple command: words and redirections
+    NODE_PIPE,      // Stages joined by |
+    NODE_AND,       // left && right
+    NODE_OR,        // left || right
+    NODE_LIST,      // Items run one after the other, or started in the background
+    NODE_SUBSHELL,  // ( list ), run by a forked copy of the shell
+    NODE_GROUP,     // { list; }, run by the shell itself
+    NODE_IF,        // if: condition, then part, else part (an elif is an if there)
+    NODE_WHILE,     // while or until: condition and body
+    NODE_FOR        // for: the variable then the words in words, the body in kids
+};
+
+#define NODE_BACKGROUND 1   // List item followed by &
+#define NODE_NEGATE 2       // Pipeline preceded by !
+#define NODE_PLAIN 4        // Simple command or for loop with nothing to expand in its words
+#define NODE_UNTIL 8        // while loop that runs until its condition succeeds
+
+// < file, > file or >> file
+typedef struct Redir {
+    int fd;               // 0 or 1
+    int append;
+    char* word;           // Target as typed, expanded when the command runs
+    struct Redir* next;
+} Redir;
+
+// Command tree, built by parse_line() in one pass over the line. Words are kept as typed,
+// quotes included: expansion happens when the command runs, so $? and variables set
+// earlier on the same line are seen.
+typedef struct Node Node;
+struct Node {
+    int type;
+    int flags;
+    int n;          // Words of a simple command, stages of a pipeline, items of a list
+    char** words;   // Simple command or for loop, NULL-terminated
+    Redir* redirs;  // Simple or compound command
+    Node* kids;     // Pipeline stages, list items, the two sides of && or ||, the body of
+                    // a subshell or group, or the parts of if, while and for, linked
+                    // through next
+    Node* next;
+    char* text;     // Source of a background list item, shown by jobs
+};
+
+// Recursive-descent parser over one line. Offsets index src, which alias expansion
+// replaces with a copy holding the alias text in place of its name.
+typedef struct {
+    const char* src;
+    size_t pos;        // Next byte to read
+    int tok;           // Current token
+    size_t start;      // Its offset and length
+    size_t len;
+    int plain;         // Current word has no quotes, backslashes or $
+    int keyword;       // Reserved word it spells, KW_NONE if none
+    int error;         // A syntax error was reported
+    int incomplete;    // ... or the input ran out where more could follow
+    Arena* arena;
+    Shell* sh;
+    int naliases;      // Aliases whose text is being read, innermost last
+    char alias_names[MAX_ALIASES][ARGLEN];
+    size_t alias_ends[MAX_ALIASES];
+} Parser;
+
+// A pipeline stage ready to launch: an external command or builtin by argv, or a compound
+// command a forked copy of the shell runs. in and out are the stage's own redirections,
+// -1 where it uses the pipe or the shell's stdin/stdout.
+typedef struct {
+    char** argv;
+    Node* body;
+    int in;
+    int out;
+} Stage;
+
+// A parsed line kept for reuse. Its tree is immutable: execution only reads it and
+// expands words into the command arena.
+typedef struct CacheEntry {
+    unsigned long hash;
+    char* line;
+    Node* tree;
+    Arena store;                // Holds line and tree, sized exactly
+    struct CacheEntry* older;   // Least recently used order
+    struct CacheEntry* newer;
+} CacheEntry;
+
+// A variable named in compiled code. The slot it was found in stays valid while the
+// table neither grows nor gains a name, so a loop hashes each name once, not every pass.
+typedef struct {
+    char* name;
+    size_t len;
+    Var* var;       // NULL if it was not set at the last lookup
+    Var* slots;     // Table layout the lookup was made against
+    int count;
+} VarRef;
+
+// A word compiled for the VM: literal text and variable references in turn. Only words of
+// plain text and $NAME or ${NAME}, bare or all in double quotes, are compiled; others
+// expand through expand_word() every time.
+typedef struct {
+    char* text;      // Literal, NUL-terminated, when var is NULL
+    size_t len;
+    VarRef* var;
+} Piece;
+
+typedef struct {
+    Piece* pieces;
+    int n;
+    int quoted;      // Kept when it comes out empty
+} Word;
+
+// Instructions of the control-flow VM. Each works on the status register, set by every
+// command and tested by the jumps.
+enum {
+    OP_EXEC,            // node: pipelines, external commands, redirections, through exec_node()
+    OP_BACKGROUND,      // node: list item followed by &
+    OP_BUILTIN,         // builtin, node: builtin whose words need no expansion
+    OP_BUILTIN_WORDS,   // builtin, words: builtin run on its compiled words
+    OP_BUILTIN_EXPAND,  // builtin, node: builtin run on its expanded words
+    OP_SET,             // var = value, a constant
+    OP_COPY,            // var = from, one variable copied to another
+    OP_CONCAT,          // var = words[0], a compiled word
+    OP_ARITH,           // var = $((value)), kept as an integer
+    OP_ASSIGN,          // node: any other NAME=value command
+    OP_STATUS,          // status = arg; true, false, break and continue
+    OP_NOT,             // status = !status, for ! cmd
+    OP_JUMP,            // to arg
+    OP_JUMP_TRUE,       // to arg if status is 0
+    OP_JUMP_FALSE,      // to arg if status is not 0
+    OP_LOOP_INIT,       // slot: enter a while or until loop
+    OP_FOR_INIT,        // slot, node: enter a for loop, expanding its words
+    OP_FOR_NEXT,        // slot, var: assign the next word, or jump to arg after the last
+    OP_LOOP,            // slot: end of a pass, release its memory and jump to arg
+    OP_LOOP_STATUS,     // slot: status = the last pass's
+    OP_END
+};
+
+typedef struct {
+    int op;
+    int arg;                 // Jump target or status
+    int slot;                // LoopState of loop instructions
+    Node* node;              // Command the instruction runs
+    const Builtin* builtin;
+    VarRef* var;             // Variable assigned
+    VarRef* from;            // OP_COPY source
+    char* value;             // OP_SET value, OP_ARITH expression
+    Word* words;             // Compiled words, as many as the node has
+} Instr;
+
+// A loop being compiled: its break and continue jumps wait in chains through arg until
+// their targets are known
+typedef struct LoopCtx {
+    int slot;
+    int breaks;
+    int continues;
+    struct LoopCtx* outer;
+} LoopCtx;
+
+// Compiled if, while or for statement, in the command arena
+typedef struct {
+    Instr* instrs;
+    int len;
+    int cap;
+    int loops;       // LoopState slots it needs, one per loop
+    LoopCtx* loop;   // Innermost loop while compiling
+} Code;
+
+// What a running loop keeps between passes
+typedef struct {
+    char** items;    // for: words left to assign, NULL-terminated
+    int next;
+    int status;      // Status of the last pass
+    ArenaMark mark;  // The command arena goes back here after every pass
+} LoopState;
+
+// $(( )) and let: C integer arithmetic on longs, evaluated straight off the text by
+// recursive descent. Variables are read and written as integers through Var's cache, so
+// a counter is never turned back from decimal text while only arithmetic updates it.
+// Evaluation stops at the first error; the side of && || ?: not taken runs with skip
+// set, which parses it without assigning or dividing.
+typedef struct {
+    const char* p;
+    const char* error;
+    int skip;
+    int depth;       // Variables whose values are being evaluated as expressions
+    VarTable* vars;
+} Arith;
+
+typedef struct Job Job;
+
+// A child process, reaped exactly once through the event loop
+typedef struct {
+    pid_t pid;
+    int pidfd;      // Registered with the event loop; -1 if pidfd_open is unavailable
+    int status;     // Exit code, 128+signal if killed; valid once done
+    int done;
+    Job* job;
+} Proc;
+
+// A pipeline the shell started. Foreground jobs are waited for, background ones numbered;
+// all live jobs are on one list until they are collected.
+struct Job {
+    int id;         // [n] for background jobs, 0 in the foreground
+    int nprocs;
+    int running;    // Procs not reaped yet
+    int status;     // Last stage's exit code once running reaches 0
+    int reported;   // Already shown as finished by jobs, so collect it quietly
+    struct timespec start;  // CLOCK_MONOTONIC launch time
+    struct timespec end;    // When the last stage exited
+    char* command;  // Command line as typed, "" in the foreground
+    Proc* procs;    // One per stage; procs and command are allocated with the job
+    Job* prev;
+    Job* next;
+    Job* done_next; // Finished background jobs waiting to be collected
+    // A job held back by set -o maxjobs keeps what it needs to start later
+    int queued;
+    Stage* stages;  // Copied out of the command arena, NULL once not queued; the
+                    // stages' redirections stay open meanwhile
+    Arena store;    // Compound stages' command trees
+    long pipe_bytes;
+    Shell* sh;
+    int cwd_fd;     // O_PATH handle on the directory it was started from, or -1
+    char** env;     // exec_env and PATH as they were at &, in one block
+    char* path;
+    Job* queue_prev;
+    Job* queue_next;
+};
+
+// Open addressing table from a nonzero int key (a job id or a pid) to a pointer,
+// linear probing with backward-shift deletion like the command hash
+typedef struct {
+    int key;        // 0 for an empty slot
+    void* value;
+} IndexSlot;
+
+typedef struct {
+    IndexSlot* slots;
+    int size;       // Always a power of two
+    int count;
+} Index;
+
+int execute(Node* node, Shell* sh, int last, int background);
+int exec_node(Node* node, Shell* sh, int last);
+int exec_group(Node* node, Shell* sh, int last);
+int run_code(Node* node, Shell* sh);
+int vm_run(Code* code, Shell* sh);
+void compile_node(Code* code, Node* node);
+void compile_compound(Code* code, Node* node);
+void compile_command(Code* code, Node* node);
+void compile_loop_exit(Code* code, Node* node);
+int emit(Code* code, int op, Node* node);
+void patch(Code* code, int chain, int target);
+VarRef* var_ref_new(const char* name, size_t len);
+Var* var_ref_find(VarRef* ref, VarTable* vars);
+void var_ref_set(VarRef* ref, const char* value, VarTable* vars);
+void var_ref_set_num(VarRef* ref, long num, VarTable* vars);
+size_t var_ref_name(const char* word, const char** name);
+int compile_word(Word* w, const char* word);
+char* word_expand(Word* w, VarTable* vars);
+pid_t subshell_stage(Node* body, Shell* sh, int in_fd, int out_fd, int close_fds[], int nclose);
+int open_redirs(Redir* r, int* in, int* out, VarTable* vars);
+void close_stages(Stage stages[], int n);
+int run_builtin(const Builtin* b, char* argv[], Shell* sh, int fd);
+pid_t builtin_stage(const Builtin* b, char* argv[], Shell* sh, int in_fd, int out_fd, int close_fds[], int nclose);
+const Builtin* find_builtin(const char* name);
+void builtin_init();
+int builtin_alias(char* argv[], Shell* sh, Out* out);
+int builtin_unalias(char* argv[], Shell* sh, Out* out);
+int builtin_set(char* argv[], Shell* sh, Out* out);
+int builtin_export(char* argv[], Shell* sh, Out* out);
+int builtin_cd(char* argv[], Shell* sh, Out* out);
+int builtin_exit(char* argv[], Shell* sh, Out* out);
+int builtin_history(char* argv[], Shell* sh, Out* out);
+int builtin_hash(char* argv[], Shell* sh, Out* out);
+int builtin_stats(char* argv[], Shell* sh, Out* out);
+int builtin_help(char* argv[], Shell* sh, Out* out);
+int builtin_echo(char* argv[], Shell* sh, Out* out);
+int builtin_printf(char* argv[], Shell* sh, Out* out);
+int builtin_true(char* argv[], Shell* sh, Out* out);
+int builtin_false(char* argv[], Shell* sh, Out* out);
+int builtin_let(char* argv[], Shell* sh, Out* out);
+int builtin_pwd(char* argv[], Shell* sh, Out* out);
+int builtin_test(char* argv[], Shell* sh, Out* out);
+int builtin_tee(char* argv[], Shell* sh, Out* out);
+int builtin_batch(char* argv[], Shell* sh, Out* out);
+int builtin_break(char* argv[], Shell* sh, Out* out);
+int move_bytes(int from, int to, size_t len);
+int elide_cat(Stage stages[], int num_cmds);
+int run_batch(char* argv[], int in, int out, Shell* sh);
+void batch_reap(Job* running[], int* nrunning, int* status);
+void events_init();
+void events_reset();
+int events_poll(int timeout);
+Job* job_create(pid_t pids[], int n, const char* command, int background);
+Job* job_alloc(int n, const char* command, int background);
+void job_track(Job* job, pid_t pids[]);
+Job* job_queue(Stage stages[], int n, long pipe_bytes, const char* command, Shell* sh);
+void job_unqueue(Job* job);
+void job_launch(Job* job);
+void jobs_start_queued();
+Job* job_lookup(const char* spec);
+pid_t batch_stage(char* argv[], int in, int out, Shell* sh);
+int builtin_wait(char* argv[], Shell* sh, Out* out);
+void sigchld_watch(int on);
+void job_free(Job* job);
+int job_wait(Job* job);
+void jobs_collect();
+void proc_reap(Proc* p, int st);
+int builtin_jobs(char* argv[], Shell* sh, Out* out);
+int builtin_kill(char* argv[], Shell* sh, Out* out);
+int signal_number(const char* name);
+void* index_get(Index* index, int key);
+void index_put(Index* index, int key, void* value);
+void index_remove(Index* index, int key);
+unsigned long index_hash(int key);
+int test_or(char** argv, int* i, int argc, int* error);
+int test_and(char** argv, int* i, int argc, int* error);
+int test_not(char** argv, int* i, int argc, int* error);
+int test_primary(char** argv, int* i, int argc, int* error);
+int test_number(const char* str, long* value, int* error);
+void out_init(Out* out, int fd);
+void out_write(Out* out, const char* data, size_t len);
+void out_puts(Out* out, const char* str);
+void out_printf(Out* out, const char* fmt, ...);
+int out_escape(Out* out, const char** p);
+int out_flush(Out* out);
+Node* parse_line(const char* line, Shell* sh, int* status);
+Node* parse_tree(const char* line, Shell* sh, int* status);
+Node* parse_cache_find(const char* line, unsigned long hash);
+Node* parse_cache_store(const char* line, unsigned long hash, Node* tree);
+void parse_cache_remove(CacheEntry* e);
+void parse_cache_trim();
+size_t node_size(Node* node);
+Node* parse_list(Parser* ps);
+Node* parse_and_or(Parser* ps);
+Node* parse_pipeline(Parser* ps);
+Node* parse_command(Parser* ps);
+Node* parse_simple(Parser* ps);
+Node* parse_if(Parser* ps);
+Node* parse_while(Parser* ps);
+Node* parse_for(Parser* ps);
+int list_end(Parser* ps);
+int expect(Parser* ps, int keyword);
+void skip_newlines(Parser* ps);
+Redir* parse_redir(Parser* ps);
+void parse_error(Parser* ps, const char* msg);
+void lex(Parser* ps);
+int alias_expand(Parser* ps);
+Node* node_new(Parser* ps, int type);
+Node* node_copy(Node* node, Arena* arena);
+char* read_cmd(char*, LineReader*, History*);
+void reader_init(LineReader* reader, int fd);
+void reader_init_string(LineReader* reader, const char* str);
+char** expand_words(char** words, int nwords, Arena* arena, VarTable* vars);
+char* expand_word(char* word, Arena* arena, VarTable* vars);
+const char* expand_param(StrBuf* b, const char* p, char* numbuf, VarTable* vars);
+const char* expand_backquote(StrBuf* b, const char* p, int dquoted);
+void command_subst(StrBuf* b, const char* cmd, size_t len);
+int arith_eval(const char* expr, long* result, VarTable* vars);
+long arith_run(Arith* a);
+void arith_fail(Arith* a, const char* error);
+void arith_space(Arith* a);
+int arith_number(const char* str, long* num);
+long arith_comma(Arith* a);
+long arith_assign(Arith* a);
+long arith_ternary(Arith* a);
+int arith_binop(const char* p, int* len);
+long arith_binary(Arith* a, int min_prec);
+long arith_apply(Arith* a, const char* op, int len, long l, long r);
+long arith_unary(Arith* a);
+long arith_primary(Arith* a);
+long arith_var(Arith* a, const char* name, size_t len);
+long arith_text(Arith* a, const char* text);
+void arith_store(Arith* a, const char* name, size_t len, long value);
+const char* arith_end(const char* p);
+const char* dquote_end(const char* p);
+const char* subst_end(const char* p);
+char* arith_word(const char* word);
+void sb_init(StrBuf* b, Arena* arena, size_t cap);
+void sb_reserve(StrBuf* b, size_t len);
+void sb_put(StrBuf* b, const char* str, size_t len);
+void sb_read(StrBuf* b, int fd);
+const char* special_param(char c, char* numbuf);
+const char* param_value(const char* p, size_t* consumed, char* numbuf, VarTable* vars);
+char* read_line(LineReader* reader);
+void history_init(History* history, long capacity);
+void history_resize(History* history, long capacity);
+void add_to_history(char* cmd, History* history);
+char* history_get(History* history, long event);
+void list_history(History* history, long count, Out* out);
+void history_repack(History* history, size_t new_size);
+void history_open(History* history, const char* path);
+long history_scan(History* history, const char* data, size_t len, int add, int skip_own);
+void history_sync(History* history);
+void history_append(History* history, const char* cmd);
+void history_checkpoint(History* history);
+unsigned long gram_slot(History* history, uint32_t key);
+Posting* gram_find(History* history, uint32_t key, int create);
+CmdFreq* freq_find(History* history, unsigned long hash, int create);
+void history_index(History* history, long event, const char* text);
+void history_forget(History* history, long event);
+int history_search(History* history, const char* query, long results[], int max);
+char* edit_line(const char* prompt, History* history);
+int read_key();
+void term_write(const char* str, size_t len);
+void term_puts(const char* str);
+void refresh_line(const char* prompt, const char* buf, size_t len, size_t pos);
+void edit_set(size_t* len, size_t* pos, const char* text);
+int log2_16(unsigned long x);
 void set_alias(char* name, char* command, Alias aliases[], int* alias_count);
 char* get_alias(char* name, Alias aliases[], int alias_count);
 void remove_alias(char* name, Alias aliases[], int* alias_count);
-void set_var(char* str, int global, Var vars[], int* var_count);
-char* get_var(char* name, Var vars[], int var_count);
-void list_vars(Var vars[], int var_count);
+void set_var(char* str, int global, VarTable* vars);
+Var* set_var_value(const char* name, size_t name_len, const char* value, int global, VarTable* vars);
+void var_store(Var* var, const char* value, int global);
+void var_store_num(Var* var, long num);
+void set_var_num(const char* name, size_t name_len, long num, VarTable* vars);
+int var_number(Var* var, long* num);
+Var* find_var(const char* name, size_t name_len, VarTable* vars);
+char* get_var(const char* name, VarTable* vars);
+void list_vars(VarTable* vars, Out* out);
+int assign_vars(char* words[], Shell* sh);
+int is_assignment(const char* word);
+int assignments_only(char* words[]);
+char** update_env(VarTable* vars);
+size_t name_length(const char* p);
+pid_t spawn_stage(char* argv[], int in_fd, int out_fd);
+pid_t fork_stage(char* argv[], int in_fd, int out_fd);
+int launch_pipeline(Stage stages[], int num_cmds, pid_t pids[], Shell* sh, long pipe_bytes);
+int parse_size(const char* str, long* size);
+int set_option(const char* opt, Out* out);
+unsigned long hash_str(const char* str);
+unsigned long hash_strn(const char* str, size_t len);
+const char* search_path(void);
+char* find_in_path(const char* name);
+char* hash_lookup(const char* name);
+void hash_remove(const char* name);
+void hash_clear();
+int hash_builtin(char* cmd[], Out* out);
+void* xmalloc(size_t size);
+void* xcalloc(size_t count, size_t size);
+void* xrealloc(void* ptr, size_t size);
+char* xstrdup(const char* str);
+void* arena_alloc(Arena* arena, size_t size);
+char* arena_strndup(Arena* arena, const char* str, size_t len);
+void arena_reset(Arena* arena);
+void arena_free(Arena* arena);
+void arena_init(Arena* arena, size_t size);
+ArenaMark arena_mark(Arena* arena);
+void arena_rewind(Arena* arena, ArenaMark mark);
+void print_stats(Out* out);
+
+extern char** environ;
+
+// How pipeline stages are started: posix_spawn (vfork-style, no page table copy) or plain fork
+int spawn_mode = SPAWN_POSIX;
+
+// Every heap allocation the shell makes goes through xmalloc/xcalloc/xstrdup and is counted here
+long heap_calls = 0;
+
+// Arena owning the current command line, its tokens and argv arrays
+Arena cmd_arena = { NULL, NULL, 0, 0, 0 };
+
+// Shell input and whether it is a terminal (prompts are only shown for terminals)
+LineReader input;
+int interactive = 0;
+
+// $0, the positional parameters and $? for script and -c modes
+char* arg0 = "shell";
+char** pos_args = NULL;
+int pos_count = 0;
+int last_status = 0;
+
+// Set once a failed expansion has been reported. Whoever expands a command clears it
+// first and, if it is set afterwards, gives status 1 instead of running the command.
+int expansion_failed = 0;
+
+// Status of the last command substitution, which a command of nothing but assignments
+// returns
+int subst_status = 0;
+
+// The shell, for command substitutions, which run commands from inside expansion
+Shell* current_shell = NULL;
+
+// Set for the final command of a -c string so it replaces the shell instead of forking
+int exec_in_place = 0;
+
+// Signal mask the shell started with, restored in every child
+sigset_t child_sigmask;
+
+// Environment handed to every exec: environ merged with exported variables in one block.
+// It is only rebuilt when env_generation moves, i.e. when an exported variable changes.
+char** exec_env = NULL;
+unsigned long env_generation = 1;
+unsigned long env_built_generation = 0;
+long env_rebuilds = 0;
+
+// PATH a queued job captured when it was typed, used for lookups while it starts
+const char* job_path = NULL;
+
+// Command location cache: name -> absolute path, open addressing with linear probing
+HashEntry* cmd_hash = NULL;
+int cmd_hash_size = 0;
+int cmd_hash_count = 0;
+long cmd_hash_hits = 0;
+long cmd_hash_misses = 0;
+char* cmd_hash_path = NULL;  // Value of PATH the cached entries were resolved against
+
+// set -o pipesize: capacity given to every pipeline pipe with F_SETPIPE_SZ, 0 for the kernel default
+long pipe_size = 0;
+
+// set -o maxjobs: most background jobs running at once, 0 for no limit; later ones queue
+long max_jobs = 0;
+
+// Pipeline stages removed by elide_cat()
+long cat_elided = 0;
+
+// Parse cache: line text -> command tree, in open addressing with linear probing and an
+// LRU list. Lines are looked up as typed (after ! history expansion); aliases are part of
+// the tree, so changing one marks every entry stale. Entries are only freed between lines
+// by parse_cache_trim(), never while a tree may be running.
+CacheEntry* parse_cache[PARSE_CACHE_SLOTS];
+int parse_cache_count = 0;
+size_t parse_cache_bytes = 0;
+int parse_cache_stale = 0;
+CacheEntry* parse_cache_oldest = NULL;
+CacheEntry* parse_cache_newest = NULL;
+long parse_cache_hits = 0;
+long parse_cache_misses = 0;
 
 // Global job counter to number background jobs
 int job_counter = 1;
 
-// Signal handler to reap background processes
-void handle_sigchld(int sig) {
-    int saved_errno = errno;
-    while (waitpid(-1, NULL, WNOHANG) > 0);  // Reap all child processes
-    errno = saved_errno;
-}
-
-int main() {
-    // Set up signal handler to handle SIGCHLD for background process reaping
-    struct sigaction sa;
-    sa.sa_handler = &handle_sigchld;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa, 0) == -1) {
-        perror("sigaction");
-        exit(1);
+// Event loop: an epoll set holding a pidfd per foreground child plus a signalfd for
+// SIGCHLD, which stays blocked in the shell. Foreground children are reaped through their
+// own pidfd. Background children are unwatched: a pidfd each would grow the fd table every
+// exec has to sweep, so SIGCHLD reaps them with waitpid(-1) and the pid index instead.
+// The signalfd is only in the set while unwatched children exist.
+int event_fd = -1;
+int sigchld_fd = -1;
+int sigchld_watched = 0;
+int unwatched = 0;
+Job* jobs_first = NULL;  // Live jobs, oldest first
+Job* jobs_last = NULL;
+Job* jobs_done = NULL;   // Finished background jobs not collected yet
+Job* queue_first = NULL; // Background jobs waiting for a maxjobs slot, in launch order
+Job* queue_last = NULL;
+int queued_jobs = 0;
+int bg_running = 0;      // Background jobs started and not finished
+Index job_ids = { NULL, 0, 0 };   // Background job id -> Job*
+Index job_pids = { NULL, 0, 0 };  // pid of every running stage -> Proc*
+
+int main(int argc, char* argv[]) {
+    char* command_string = NULL;
+
+    // shell -c 'cmd' [name [args...]] or shell script [args...]
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        command_string = argv[2];
+        if (argc > 3) {
+            arg0 = argv[3];
+            pos_args = argv + 4;
+            pos_count = argc - 4;
+        }
+        reader_init_string(&input, command_string);
+    } else if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(argv[1]);
+            return 127;
+        }
+        arg0 = argv[1];
+        pos_args = argv + 2;
+        pos_count = argc - 2;
+        reader_init(&input, fd);
+    } else {
+        arg0 = argv[0];
+        reader_init(&input, STDIN_FILENO);
+        interactive = isatty(STDIN_FILENO);
     }
 
-    char *cmdline;
-    char** cmd;
-    char* history[MAX_HISTORY] = { NULL }; // Command history array
-    int history_count = 0; // Count of commands in history
+    sigprocmask(SIG_SETMASK, NULL, &child_sigmask);
+
+    // Children are collected through the event loop from here on
+    events_init();
+
+    char *cmdline, *more;
+    Node* tree;
+    int parse_status;
+    History history; // Command history ring
     Alias aliases[MAX_ALIASES] = { { "", "" } }; // Alias array
     int alias_count = 0; // Count of aliases
-    Var vars[MAX_VARS] = { { NULL, 0 } }; // Variable array
-    int var_count = 0; // Count of variables
+    VarTable vars = { NULL, 0, 0 }; // Variable table
+    Shell shell = { &history, aliases, &alias_count, &vars };
+    current_shell = &shell;
+
+    char* histsize = getenv("HISTSIZE");
+    history_init(&history, histsize != NULL && atol(histsize) > 0 ? atol(histsize) : DEFAULT_HISTSIZE);
+    if (interactive) {
+        char path[PATH_MAX];
+        char* histfile = getenv("HISTFILE");
+        if (histfile == NULL && getenv("HOME") != NULL) {
+            snprintf(path, sizeof(path), "%s/.shell_history", getenv("HOME"));
+            histfile = path;
+        }
+        if (histfile != NULL) history_open(&history, histfile);
+    }
 
-    while((cmdline = read_cmd(PROMPT, stdin)) != NULL) {
-        // Check for command history repeat
-        if (cmdline[0] == '!') {
+    while((cmdline = read_cmd(PROMPT, &input, &history)) != NULL) {
+        // Take in what other sessions ran while we waited for input
+        history_sync(&history);
+
+        // Check for command history repeat; "! cmd" is a negated pipeline
+        if (cmdline[0] == '!' && cmdline[1] != ' ' && cmdline[1] != '\t' && cmdline[1] != '\0') {
             if (strcmp(cmdline, "!-1") == 0) {
                 // Repeat last command
-                if (history_count > 0) {
-                    free(cmdline);
-                    cmdline = strdup(history[history_count - 1]);
+                if (history.next > history.first) {
+                    cmdline = history_get(&history, history.next - 1); // parse_line() copies, no need to duplicate
                 } else {
                     printf("No commands in history.\n");
-                    free(cmdline);
+                    arena_reset(&cmd_arena);
                     continue;
                 }
             } else {
-                int cmd_num = atoi(&cmdline[1]);
-                if (cmd_num >= 1 && cmd_num <= history_count) {
-                    free(cmdline);
-                    cmdline = strdup(history[cmd_num - 1]);
-                } else {
+                // Event numbers never shift, so !n means the same command as long as it is kept
+                cmdline = history_get(&history, atol(&cmdline[1]));
+                if (cmdline == NULL) {
                     printf("No such command in history.\n");
-                    free(cmdline);
+                    arena_reset(&cmd_arena);
                     continue;
                 }
             }
-        } else {
-            add_to_history(cmdline, history, &history_count); // Add command to history
+        } else if (interactive) {
+            add_to_history(cmdline, &history); // Add command to history
+            history_append(&history, cmdline);
         }
 
-        if((cmd = tokenize(cmdline)) != NULL) {
-            // Check for alias command
-            if (strcmp(cmd[0], "alias") == 0) {
-                if (cmd[1] != NULL) {
-                    char* eq = strchr(cmd[1], '=');
-                    if (eq != NULL) {
-                        *eq = '\0';
-                        set_alias(cmd[1], eq + 1, aliases, &alias_count);
-                    } else {
-                        printf("Invalid alias format.\n");
-                    }
-                } else {
-                    for (int i = 0; i < alias_count; i++) {
-                        printf("alias %s='%s'\n", aliases[i].name, aliases[i].command);
-                    }
-                }
-            } else if (strcmp(cmd[0], "unalias") == 0) {
-                if (cmd[1] != NULL) {
-                    remove_alias(cmd[1], aliases, &alias_count);
-                } else {
-                    printf("unalias: missing operand\n");
-                }
-            } else if (strcmp(cmd[0], "set") == 0) {
-                if (cmd[1] != NULL) {
-                    set_var(cmd[1], 0, vars, &var_count);
-                } else {
-                    list_vars(vars, var_count);
-                }
-            } else if (strcmp(cmd[0], "export") == 0) {
-                if (cmd[1] != NULL) {
-                    set_var(cmd[1], 1, vars, &var_count);
-                } else {
-                    printf("export: missing operand\n");
-                }
-            } else {
-                // Check if the command is an alias
-                char* alias_command = get_alias(cmd[0], aliases, alias_count);
-                if (alias_command != NULL) {
-                    free(cmdline);
-                    cmdline = strdup(alias_command);
-                    free(cmd);
-                    cmd = tokenize(cmdline);
-                }
-                execute(cmd, history, &history_count, aliases, &alias_count, vars, &var_count);
+        // Aliases are expanded while parsing; everything else when each command runs. A
+        // command left open (if without fi, a trailing &&, an open quote...) takes in lines
+        // until it is complete, and the whole text is parsed again each time.
+        parse_status = 0;
+        while ((tree = parse_line(cmdline, &shell, &parse_status)) == NULL && parse_status == PARSE_MORE) {
+            cmdline = arena_strndup(&cmd_arena, cmdline, strlen(cmdline));
+            if ((more = read_cmd(PROMPT_MORE, &input, &history)) == NULL) {
+                fprintf(stderr, "syntax error: unexpected end of file\n");
+                parse_status = 2;
+                break;
             }
-            for(int j = 0; j < MAXARGS + 1; j++) free(cmd[j]);
-            free(cmd);
-            free(cmdline);
+            if (interactive) {
+                add_to_history(more, &history);
+                history_append(&history, more);
+            }
+            size_t len = strlen(cmdline), more_len = strlen(more);
+            char* joined = arena_alloc(&cmd_arena, len + more_len + 2);
+            memcpy(joined, cmdline, len);
+            joined[len] = '\n';
+            memcpy(joined + len + 1, more, more_len + 1);
+            cmdline = joined;
+        }
+        // The last line of a -c string may exec directly
+        exec_in_place = command_string != NULL && input.eof && input.start == input.end;
+        if (tree != NULL) {
+            last_status = exec_node(tree, &shell, exec_in_place);
+        } else if (parse_status != 0) {
+            last_status = parse_status;
         }
+        // Line buffer, command tree and argv all go at once
+        arena_reset(&cmd_arena);
+        parse_cache_trim();
+        // Reap and report background jobs that finished meanwhile
+        jobs_collect();
     }
-    printf("\n");
-    // Free history commands
-    for (int i = 0; i < history_count; i++) {
-        free(history[i]);
+    if (interactive) printf("\n");
+    // Free history
+    history_sync(&history);
+    history_checkpoint(&history);
+    free(history.entries);
+    free(history.pool);
+    for (long i = 0; i < history.grams_size; i++) {
+        free(history.grams[i].events);
     }
+    free(history.grams);
+    free(history.freq);
     // Free variables
-    for (int i = 0; i < var_count; i++) {
-        free(vars[i].str);
+    for (int i = 0; i < vars.size; i++) {
+        if (vars.slots[i].name != NULL) {
+            free(vars.slots[i].name);
+            free(vars.slots[i].value);
+        }
+    }
+    free(vars.slots);
+    return last_status;
+}
+
+void history_init(History* history, long capacity) {
+    history->capacity = capacity;
+    history->entries = xmalloc(sizeof(HistEntry) * capacity);
+    history->first = 1;
+    history->next = 1;
+    history->pool_size = HIST_POOL_INIT;
+    history->pool = xmalloc(history->pool_size);
+    history->pool_head = 0;
+    history->fd = -1;
+    history->grams = NULL;
+    history->grams_size = 0;
+    history->grams_count = 0;
+    history->freq = NULL;
+    history->freq_size = 0;
+    history->freq_used = 0;
+}
+
+// Copy the retained entries, oldest first, to the start of a pool of new_size bytes
+void history_repack(History* history, size_t new_size) {
+    char* pool = xmalloc(new_size);
+    size_t head = 0;
+    for (long e = history->first; e < history->next; e++) {
+        HistEntry* entry = &history->entries[e % history->capacity];
+        memcpy(pool + head, history->pool + entry->offset, entry->len + 1);
+        entry->offset = head;
+        head += entry->len + 1;
+    }
+    free(history->pool);
+    history->pool = pool;
+    history->pool_size = new_size;
+    history->pool_head = head;
+}
+
+// Change the capacity, keeping the newest entries that still fit
+void history_resize(History* history, long capacity) {
+    HistEntry* entries = xmalloc(sizeof(HistEntry) * capacity);
+    while (history->next - history->first > capacity) {
+        history_forget(history, history->first++);
+    }
+    for (long e = history->first; e < history->next; e++) {
+        entries[e % capacity] = history->entries[e % history->capacity];
+    }
+    free(history->entries);
+    history->entries = entries;
+    history->capacity = capacity;
+    history_repack(history, history->pool_size);
+}
+
+// Append a command in O(1): the oldest event is dropped when the ring is full, and the text
+// goes at the pool head, wrapping to the front of the pool or growing it when it does not fit
+void add_to_history(char* cmd, History* history) {
+    size_t len = strlen(cmd);
+    size_t need = len + 1;
+    size_t pos;
+
+    if (history->next - history->first == history->capacity) {
+        history_forget(history, history->first++);
+    }
+    while (1) {
+        long count = history->next - history->first;
+        if (count == 0) {
+            if (need > history->pool_size) history_repack(history, need * 2);
+            pos = 0;
+            break;
+        }
+        size_t tail = history->entries[history->first % history->capacity].offset;
+        size_t head = history->pool_head;
+        if (head > tail) {
+            // Live text is [tail, head): room after head, or wrap to the front
+            if (history->pool_size - head >= need) {
+                pos = head;
+                break;
+            }
+            if (tail >= need) {
+                pos = 0;
+                break;
+            }
+        } else if (tail - head >= need) {
+            // Live text wraps around: the gap is [head, tail)
+            pos = head;
+            break;
+        }
+        // The ring has a free slot, so the retained text just needs a bigger pool
+        history_repack(history, history->pool_size * 2 + need);
+    }
+
+    HistEntry* entry = &history->entries[history->next % history->capacity];
+    memcpy(history->pool + pos, cmd, need);
+    entry->offset = pos;
+    entry->len = len;
+    history->pool_head = pos + need;
+    history_index(history, history->next, history->pool + pos);
+    history->next++;
+}
+
+// Attach the shared history log at path and load its newest records.
+// The log is append-only: every command is one "<pid>\t<command>\n" record written with a
+// single O_APPEND write, so concurrent shells never interleave. A checkpoint file next to it
+// ("<path>.idx") records how many records precede a byte offset; only the bytes after it are
+// counted at startup, and only the records that fit in the ring are parsed.
+void history_open(History* history, const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    history->fd = fd;
+    history->file_path = xstrdup(path);
+    history->file_end = 0;
+    history->file_records = 0;
+    // The start time keeps the tag unique when a pid is reused
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(history->tag, sizeof(history->tag), "%x.%llx\t", (unsigned)getpid(),
+             (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec);
+    if (st.st_size == 0) return;
+
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        history->file_end = st.st_size;
+        return;
+    }
+    // Only whole records count; a torn last line is picked up once it is complete
+    char* last_nl = memrchr(map, '\n', st.st_size);
+    size_t end = last_nl ? (size_t)(last_nl - map) + 1 : 0;
+
+    // Trust the checkpoint if it points at a record boundary inside the file
+    char idx_path[PATH_MAX];
+    long long ck_offset = 0;
+    long ck_records = 0;
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    FILE* idx = fopen(idx_path, "r");
+    if (idx != NULL) {
+        if (fscanf(idx, "shellhist 1 %lld %ld", &ck_offset, &ck_records) != 2 ||
+            ck_offset < 0 || (size_t)ck_offset > end || (ck_offset > 0 && map[ck_offset - 1] != '\n')) {
+            ck_offset = 0;
+            ck_records = 0;
+        }
+        fclose(idx);
+    }
+    long total = ck_records + history_scan(history, map + ck_offset, end - ck_offset, 0, 0);
+
+    // Walk back from the end to where the newest `capacity` records start
+    size_t start = end;
+    long loaded = 0;
+    while (start > 0 && loaded < history->capacity) {
+        char* nl = memrchr(map, '\n', start - 1);
+        start = nl ? (size_t)(nl - map) + 1 : 0;
+        loaded++;
+    }
+    history->first = history->next = total - loaded + 1;
+    history_scan(history, map + start, end - start, 1, 0);
+    munmap(map, st.st_size);
+
+    history->file_end = end;
+    history->file_records = total;
+    if (end - ck_offset > HIST_CHECKPOINT_BYTES) {
+        history_checkpoint(history);
+    }
+}
+
+// Count the newline-terminated records in data; with add set, also put them in the ring.
+// skip_own leaves out this session's own records, which were added when they were typed.
+long history_scan(History* history, const char* data, size_t len, int add, int skip_own) {
+    long records = 0;
+    size_t tag_len = strlen(history->tag);
+    const char* end = data + len;
+    char line[4096];
+
+    while (data < end) {
+        const char* nl = memchr(data, '\n', end - data);
+        if (nl == NULL) break;
+        records++;
+        int own = skip_own && (size_t)(nl - data) >= tag_len && memcmp(data, history->tag, tag_len) == 0;
+        if (add && !own) {
+            const char* text = memchr(data, '\t', nl - data);
+            text = text ? text + 1 : data;
+            size_t text_len = nl - text;
+            char* copy = text_len < sizeof(line) ? line : arena_alloc(&cmd_arena, text_len + 1);
+            memcpy(copy, text, text_len);
+            copy[text_len] = '\0';
+            add_to_history(copy, history);
+        }
+        data = nl + 1;
+    }
+    return records;
+}
+
+// Pick up records other sessions appended since we last looked; costs one fstat when idle
+void history_sync(History* history) {
+    struct stat st;
+    if (history->fd < 0 || fstat(history->fd, &st) < 0 || st.st_size <= history->file_end) {
+        return;
+    }
+    // Map from the page holding file_end to the current end
+    long page = sysconf(_SC_PAGESIZE);
+    off_t base = history->file_end & ~(off_t)(page - 1);
+    size_t map_len = st.st_size - base;
+    char* map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, history->fd, base);
+    if (map == MAP_FAILED) return;
+
+    char* data = map + (history->file_end - base);
+    size_t len = st.st_size - history->file_end;
+    char* last_nl = memrchr(data, '\n', len);
+    if (last_nl != NULL) {
+        len = last_nl - data + 1;
+        history->file_records += history_scan(history, data, len, 1, 1);
+        history->file_end += len;
+    }
+    munmap(map, map_len);
+}
+
+// Append one record with a single write so concurrent appends never interleave
+void history_append(History* history, const char* cmd) {
+    if (history->fd < 0) return;
+    size_t tag_len = strlen(history->tag);
+    size_t len = strlen(cmd);
+    char* record = arena_alloc(&cmd_arena, tag_len + len + 1);
+    memcpy(record, history->tag, tag_len);
+    memcpy(record + tag_len, cmd, len);
+    record[tag_len + len] = '\n';
+    if (write(history->fd, record, tag_len + len + 1) < 0) {
+        perror("history");
     }
-    return 0;
 }
 
-void add_to_history(char* cmd, char* history[], int* history_count) {
-    if (*history_count < MAX_HISTORY) {
-        history[*history_count] = strdup(cmd); // Duplicate and store command
-        (*history_count)++;
+// Save (offset, record count) for the next startup; written to a temp file and renamed in
+// so readers never see a partial checkpoint
+void history_checkpoint(History* history) {
+    if (history->fd < 0) return;
+    char idx_path[PATH_MAX], tmp_path[PATH_MAX];
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", history->file_path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.idx.%d", history->file_path, (int)getpid());
+    FILE* fp = fopen(tmp_path, "w");
+    if (fp == NULL) return;
+    fprintf(fp, "shellhist 1 %lld %ld\n", (long long)history->file_end, history->file_records);
+    if (fclose(fp) == 0) {
+        rename(tmp_path, idx_path);
     } else {
-        // Shift history left and overwrite the oldest command
-        free(history[0]); // Free the oldest command
-        for (int i = 1; i < MAX_HISTORY; i++) {
-            history[i - 1] = history[i]; // Shift left
+        unlink(tmp_path);
+    }
+}
+
+// Home slot of a trigram. The multiply alone would leave the low bits depending only on
+// the key's low bytes, so the high half is folded down before masking.
+unsigned long gram_slot(History* history, uint32_t key) {
+    uint32_t h = key * 2654435761u;
+    return (h ^ (h >> 16)) & (history->grams_size - 1);
+}
+
+// Trigram posting list for key, optionally creating an empty one
+Posting* gram_find(History* history, uint32_t key, int create) {
+    if (history->grams_size > 0) {
+        unsigned long i = gram_slot(history, key);
+        while (history->grams[i].key != 0) {
+            if (history->grams[i].key == key) return &history->grams[i];
+            i = (i + 1) & (history->grams_size - 1);
+        }
+    }
+    if (!create) return NULL;
+
+    if ((history->grams_count + 1) * 4 > history->grams_size * 3) {
+        long old_size = history->grams_size;
+        Posting* old = history->grams;
+        history->grams_size = old_size ? old_size * 2 : 1024;
+        history->grams = xcalloc(history->grams_size, sizeof(Posting));
+        for (long j = 0; j < old_size; j++) {
+            if (old[j].key != 0) {
+                unsigned long k = gram_slot(history, old[j].key);
+                while (history->grams[k].key != 0) k = (k + 1) & (history->grams_size - 1);
+                history->grams[k] = old[j];
+            }
+        }
+        free(old);
+    }
+    unsigned long i = gram_slot(history, key);
+    while (history->grams[i].key != 0) i = (i + 1) & (history->grams_size - 1);
+    history->grams[i].key = key;
+    history->grams_count++;
+    return &history->grams[i];
+}
+
+// Frequency record for a command text hash, optionally creating it with a zero count.
+// Texts no longer in history keep a zero-count record until the next resize drops them.
+CmdFreq* freq_find(History* history, unsigned long hash, int create) {
+    if (hash == 0) hash = 1;
+    if (history->freq_size > 0) {
+        unsigned long i = hash & (history->freq_size - 1);
+        while (history->freq[i].hash != 0) {
+            if (history->freq[i].hash == hash) return &history->freq[i];
+            i = (i + 1) & (history->freq_size - 1);
+        }
+    }
+    if (!create) return NULL;
+
+    if ((history->freq_used + 1) * 4 > history->freq_size * 3) {
+        long old_size = history->freq_size;
+        CmdFreq* old = history->freq;
+        history->freq_size = old_size ? old_size * 2 : 1024;
+        history->freq = xcalloc(history->freq_size, sizeof(CmdFreq));
+        history->freq_used = 0;
+        for (long j = 0; j < old_size; j++) {
+            if (old[j].hash != 0 && old[j].count > 0) {
+                unsigned long k = old[j].hash & (history->freq_size - 1);
+                while (history->freq[k].hash != 0) k = (k + 1) & (history->freq_size - 1);
+                history->freq[k] = old[j];
+                history->freq_used++;
+            }
+        }
+        free(old);
+    }
+    unsigned long i = hash & (history->freq_size - 1);
+    while (history->freq[i].hash != 0) i = (i + 1) & (history->freq_size - 1);
+    history->freq[i].hash = hash;
+    history->freq_used++;
+    return &history->freq[i];
+}
+
+// Add a new event to the search index: one posting per distinct trigram, plus its frequency
+void history_index(History* history, long event, const char* text) {
+    CmdFreq* freq = freq_find(history, hash_str(text), 1);
+    freq->count++;
+    freq->last = event;
+
+    const unsigned char* p = (const unsigned char*)text;
+    for (; p[0] && p[1] && p[2]; p++) {
+        Posting* post = gram_find(history, p[0] << 16 | p[1] << 8 | p[2], 1);
+        // A trigram repeated within one command is only listed once
+        if (post->len > post->start && post->events[post->len - 1] == (uint32_t)event) continue;
+
+        // Drop postings of events that have left the ring before growing the list
+        while (post->start < post->len && post->events[post->start] < history->first) post->start++;
+        if (post->len == post->cap) {
+            if (post->start > post->len / 2) {
+                memmove(post->events, post->events + post->start, (post->len - post->start) * sizeof(uint32_t));
+                post->len -= post->start;
+                post->start = 0;
+            } else {
+                post->cap = post->cap ? post->cap * 2 : 4;
+                post->events = xrealloc(post->events, post->cap * sizeof(uint32_t));
+            }
+        }
+        post->events[post->len++] = event;
+    }
+}
+
+// An event is leaving the ring; postings are trimmed lazily, the frequency right away
+void history_forget(History* history, long event) {
+    char* text = history_get(history, event);
+    CmdFreq* freq = text ? freq_find(history, hash_str(text), 0) : NULL;
+    if (freq != NULL && freq->count > 0) freq->count--;
+}
+
+// log2(x) in 1/16ths, enough resolution for ranking
+int log2_16(unsigned long x) {
+    if (x == 0) return 0;
+    int whole = 63 - __builtin_clzl(x);
+    int frac = whole >= 4 ? (int)((x >> (whole - 4)) & 15) : (int)((x << (4 - whole)) & 15);
+    return whole * 16 + frac;
+}
+
+// Find the retained commands containing query, best first, and store their newest events.
+// Candidates come from the query's rarest trigram (queries under three bytes scan the ring),
+// newest first, each distinct command once. Up to SEARCH_CANDIDATES are ranked by
+// 3*log2(1 + times used) - log2(age in events), so a command used often beats one used once
+// slightly more recently, while old one-offs sink.
+int history_search(History* history, const char* query, long results[], int max) {
+    long cand[SEARCH_CANDIDATES];
+    int score[SEARCH_CANDIDATES];
+    int ncand = 0;
+    size_t qlen = strlen(query);
+    if (qlen == 0) return 0;
+
+    Posting* rarest = NULL;
+    if (qlen >= 3) {
+        const unsigned char* q = (const unsigned char*)query;
+        for (size_t i = 0; i + 2 < qlen; i++) {
+            Posting* post = gram_find(history, q[i] << 16 | q[i + 1] << 8 | q[i + 2], 0);
+            if (post == NULL) return 0;  // Some trigram never occurs
+            if (rarest == NULL || post->len - post->start < rarest->len - rarest->start) rarest = post;
         }
-        history[MAX_HISTORY - 1] = strdup(cmd); // Add new command
+    }
+
+    long pos = rarest ? (long)rarest->len : history->next;
+    while (ncand < SEARCH_CANDIDATES) {
+        long event;
+        if (rarest) {
+            if (--pos < (long)rarest->start) break;
+            event = rarest->events[pos];
+            if (event < history->first) break;
+        } else {
+            if (--pos < history->first) break;
+            event = pos;
+        }
+        char* text = history_get(history, event);
+        // A single trigram list is exact; otherwise verify the text before hashing it
+        if ((qlen > 3 || !rarest) && strstr(text, query) == NULL) continue;
+        CmdFreq* freq = freq_find(history, hash_str(text), 0);
+        // Only the newest occurrence of each command is a candidate
+        if (freq == NULL || freq->last != (uint32_t)event) continue;
+        cand[ncand] = event;
+        score[ncand] = 3 * log2_16(1 + freq->count) - log2_16(history->next - event);
+        ncand++;
+    }
+
+    // Insertion sort by score; ties keep the newer event first
+    for (int i = 1; i < ncand; i++) {
+        long e = cand[i];
+        int sc = score[i];
+        int j = i - 1;
+        while (j >= 0 && score[j] < sc) {
+            cand[j + 1] = cand[j];
+            score[j + 1] = score[j];
+            j--;
+        }
+        cand[j + 1] = e;
+        score[j + 1] = sc;
+    }
+    int n = ncand < max ? ncand : max;
+    memcpy(results, cand, n * sizeof(long));
+    return n;
+}
+
+// Text of event number `event`, or NULL if it was never recorded or has been dropped
+char* history_get(History* history, long event) {
+    if (event < history->first || event >= history->next) {
+        return NULL;
+    }
+    return history->pool + history->entries[event % history->capacity].offset;
+}
+
+// history [n]: print the last n events (all retained events by default) with their numbers
+void list_history(History* history, long count, Out* out) {
+    long start = history->first;
+    if (count > 0 && history->next - count > start) {
+        start = history->next - count;
+    }
+    for (long e = start; e < history->next; e++) {
+        out_printf(out, "%5ld  %s\n", e, history_get(history, e));
     }
 }
 
 void set_alias(char* name, char* command, Alias aliases[], int* alias_count) {
+    if (strlen(name) >= ARGLEN || strlen(command) >= MAX_LEN) {
+        printf("Alias too long.\n");
+        return;
+    }
+    // Cached trees have the old alias text spliced in
+    parse_cache_stale = 1;
     for (int i = 0; i < *alias_count; i++) {
         if (strcmp(aliases[i].name, name) == 0) {
             strcpy(aliases[i].command, command);
@@ -202,6 +1392,7 @@ void remove_alias(char* name, Alias aliases[], int* alias_count) {
                 aliases[j] = aliases[j + 1];
             }
             (*alias_count)--;
+            parse_cache_stale = 1;
             printf("Alias '%s' removed.\n", name);
             return;
         }
@@ -209,212 +1400,4658 @@ void remove_alias(char* name, Alias aliases[], int* alias_count) {
     printf("Alias '%s' not found.\n", name);
 }
 
-void set_var(char* str, int global, Var vars[], int* var_count) {
-    for (int i = 0; i < *var_count; i++) {
-        if (strncmp(vars[i].str, str, strchr(vars[i].str, '=') - vars[i].str) == 0) {
-            free(vars[i].str);
-            vars[i].str = strdup(str);
-            vars[i].global = global;
-            return;
+// Set a variable from a NAME=value string; global marks it exported
+void set_var(char* str, int global, VarTable* vars) {
+    char* eq = strchr(str, '=');
+    if (eq == NULL) {
+        // export NAME exports an existing variable
+        Var* var = find_var(str, strlen(str), vars);
+        if (var != NULL && global) {
+            if (!var->global) env_generation++;
+            var->global = 1;
+        } else if (var == NULL) {
+            printf("Invalid variable format. Use NAME=value\n");
         }
+        return;
     }
-    if (*var_count < MAX_VARS) {
-        vars[*var_count].str = strdup(str);
-        vars[*var_count].global = global;
-        (*var_count)++;
-    } else {
-        printf("Variable limit reached.\n");
-    }
+    set_var_value(str, eq - str, eq + 1, global, vars);
 }
 
-char* get_var(char* name, Var vars[], int var_count) {
-    for (int i = 0; i < var_count; i++) {
-        if (strncmp(vars[i].str, name, strchr(vars[i].str, '=') - vars[i].str) == 0) {
-            return strchr(vars[i].str, '=') + 1;
+Var* find_var(const char* name, size_t name_len, VarTable* vars) {
+    if (vars->size == 0) return NULL;
+    unsigned long i = hash_strn(name, name_len) & (vars->size - 1);
+    while (vars->slots[i].name != NULL) {
+        if (strncmp(vars->slots[i].name, name, name_len) == 0 && vars->slots[i].name[name_len] == '\0') {
+            return &vars->slots[i];
         }
+        i = (i + 1) & (vars->size - 1);
     }
     return NULL;
 }
 
-void list_vars(Var vars[], int var_count) {
-    for (int i = 0; i < var_count; i++) {
-        printf("%s\n", vars[i].str);
+Var* set_var_value(const char* name, size_t name_len, const char* value, int global, VarTable* vars) {
+    Var* var = find_var(name, name_len, vars);
+    if (var != NULL) {
+        var_store(var, value, global);
+        return var;
     }
-}
 
-int execute(char* cmd[], char* history[], int* history_count, Alias aliases[], int* alias_count, Var vars[], int* var_count) {
-    int background = 0;
-    int in = -1, out = -1;
-    int num_cmds = 0;
-    char* command[MAXARGS][MAXARGS];
-    int i, j = 0;
-    pid_t pid;  // Declare pid here to capture the last command’s pid for background jobs
-
-    // Handle built-in commands
-    if (strcmp(cmd[0], "cd") == 0) {
-        if (cmd[1] == NULL) {
-            fprintf(stderr, "cd: expected argument\n");
-        } else {
-            if (chdir(cmd[1]) != 0) {
-                perror("chdir failed");
+    // Grow at 3/4 load so probe sequences stay short
+    if ((vars->count + 1) * 4 > vars->size * 3) {
+        int old_size = vars->size;
+        Var* old = vars->slots;
+        vars->size = old_size ? old_size * 2 : VARS_INIT_SIZE;
+        vars->slots = xcalloc(vars->size, sizeof(Var));
+        for (int j = 0; j < old_size; j++) {
+            if (old[j].name != NULL) {
+                unsigned long k = hash_str(old[j].name) & (vars->size - 1);
+                while (vars->slots[k].name != NULL) k = (k + 1) & (vars->size - 1);
+                vars->slots[k] = old[j];
             }
         }
-        return 1;
-    }
-    if (strcmp(cmd[0], "exit") == 0) {
-        exit(0);
-    }
-
-    // Parse command line for background, redirection, and pipes
-    for (i = 0; cmd[i] != NULL; i++) {
-        if (strcmp(cmd[i], "&") == 0) {
-            background = 1;
-            cmd[i] = NULL;
-            break;
-        } else if (strcmp(cmd[i], "<") == 0) {
-            in = open(cmd[i + 1], O_RDONLY);
-            if (in < 0) {
-                perror("Failed to open input file");
-                return -1;
-            }
-            cmd[i] = NULL;
-            i++;
-        } else if (strcmp(cmd[i], ">") == 0) {
-            out = open(cmd[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (out < 0) {
-                perror("Failed to open output file");
-                return -1;
-            }
-            cmd[i] = NULL;
-            i++;
-        } else if (strcmp(cmd[i], "|") == 0) {
-            command[num_cmds][j] = NULL;
-            num_cmds++;
-            j = 0;
-        } else {
-            command[num_cmds][j++] = cmd[i];
-        }
+        free(old);
     }
-    command[num_cmds][j] = NULL;
-    num_cmds++;
+    unsigned long i = hash_strn(name, name_len) & (vars->size - 1);
+    while (vars->slots[i].name != NULL) i = (i + 1) & (vars->size - 1);
+    var = &vars->slots[i];
+    var->name = xmalloc(name_len + 1);
+    memcpy(var->name, name, name_len);
+    var->name[name_len] = '\0';
+    var->value = xstrdup(value);
+    var->value_cap = strlen(value) + 1;
+    var->global = global;
+    var->has_num = 0;
+    vars->count++;
+    if (global) env_generation++;
+    return var;
+}
 
-    // Create pipes for each command in the pipeline
-    int pipefd[2 * (num_cmds - 1)];
-    for (i = 0; i < num_cmds - 1; i++) {
-        if (pipe(pipefd + i * 2) == -1) {
-            perror("Pipe failed");
-            exit(1);
-        }
+// New value for an existing variable, stored in place when it fits. value may be the
+// variable's own.
+void var_store(Var* var, const char* value, int global) {
+    size_t value_len = strlen(value);
+    if (value_len < var->value_cap) {
+        memmove(var->value, value, value_len + 1);
+    } else {
+        free(var->value);
+        var->value = xstrdup(value);
+        var->value_cap = value_len + 1;
     }
+    var->global |= global;
+    var->has_num = 0;
+    if (var->global) env_generation++;
+}
 
-    // Execute each command in the pipeline
-    for (i = 0; i < num_cmds; i++) {
-        pid = fork();
-        if (pid == 0) {  // Child process
-            // Redirect input for the first command
-            if (i == 0 && in != -1) {
-                dup2(in, STDIN_FILENO);
-                close(in);
-            }
-            // Redirect output for the last command
-            if (i == num_cmds - 1 && out != -1) {
-                dup2(out, STDOUT_FILENO);
-                close(out);
-            }
-
-            // Redirect input from previous pipe
-            if (i > 0) {
-                dup2(pipefd[(i - 1) * 2], STDIN_FILENO);
-            }
-            // Redirect output to next pipe
-            if (i < num_cmds - 1) {
-                dup2(pipefd[i * 2 + 1], STDOUT_FILENO);
-            }
+// Store an integer, keeping it alongside its decimal text so arithmetic reads it back
+// without parsing
+void var_store_num(Var* var, long num) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%ld", num);
+    var_store(var, buf, 0);
+    var->num = num;
+    var->has_num = 1;
+}
 
-            // Close all pipe file descriptors in the child
-            for (j = 0; j < 2 * (num_cmds - 1); j++) {
-                close(pipefd[j]);
-            }
+void set_var_num(const char* name, size_t name_len, long num, VarTable* vars) {
+    Var* var = find_var(name, name_len, vars);
+    if (var == NULL) var = set_var_value(name, name_len, "", 0, vars);
+    var_store_num(var, num);
+}
 
-            // Execute the command
-            execvp(command[i][0], command[i]);
-            perror("Command Not Found");
-            exit(1);
-        } else if (pid < 0) {
-            perror("Fork failed");
-            return -1;
-        }
+// The integer a variable holds, parsed from its text the first time and cached; 0 when
+// the text is not a number
+int var_number(Var* var, long* num) {
+    if (!var->has_num) {
+        if (!arith_number(var->value, &var->num)) return 0;
+        var->has_num = 1;
     }
+    *num = var->num;
+    return 1;
+}
+
+// A reference to a variable for compiled code, in the command arena
+VarRef* var_ref_new(const char* name, size_t len) {
+    VarRef* ref = arena_alloc(&cmd_arena, sizeof(VarRef));
+    ref->name = arena_strndup(&cmd_arena, name, len);
+    ref->len = len;
+    ref->var = NULL;
+    ref->slots = NULL;
+    ref->count = -1;
+    return ref;
+}
 
-    // Close all pipe file descriptors in the parent
-    for (i = 0; i < 2 * (num_cmds - 1); i++) {
-        close(pipefd[i]);
+// Variables are never removed, so while the table keeps its slots and count a lookup
+// still holds
+Var* var_ref_find(VarRef* ref, VarTable* vars) {
+    if (ref->slots != vars->slots || ref->count != vars->count) {
+        ref->var = find_var(ref->name, ref->len, vars);
+        ref->slots = vars->slots;
+        ref->count = vars->count;
     }
+    return ref->var;
+}
 
-    // If in the foreground, wait for all commands to complete
-    if (!background) {
-        for (i = 0; i < num_cmds; i++) {
-            wait(NULL);
-        }
+void var_ref_set_num(VarRef* ref, long num, VarTable* vars) {
+    Var* var = var_ref_find(ref, vars);
+    if (var == NULL) var = set_var_value(ref->name, ref->len, "", 0, vars);
+    var_store_num(var, num);
+}
+
+void var_ref_set(VarRef* ref, const char* value, VarTable* vars) {
+    Var* var = var_ref_find(ref, vars);
+    if (var != NULL) {
+        var_store(var, value, 0);
     } else {
-        printf("[%d] %d\n", job_counter++, pid);  // Print job number and PID for the last background process
+        set_var_value(ref->name, ref->len, value, 0, vars);
     }
+}
 
-    return 0;
+// When word is nothing but $NAME or ${NAME}, possibly in double quotes, point *name at
+// the name and return its length; otherwise return 0
+size_t var_ref_name(const char* word, const char** name) {
+    int quoted = word[0] == '"';
+    const char* p = word + quoted;
+    if (p[0] != '$') return 0;
+    int brace = p[1] == '{';
+    const char* start = p + 1 + brace;
+    size_t len = name_length(start);
+    const char* end = start + len;
+    if (len == 0 || (brace && *end++ != '}') || (quoted && *end++ != '"') || *end != '\0') return 0;
+    *name = start;
+    return len;
 }
 
-// Tokenize function to split command into arguments
-char** tokenize(char* cmdline) {
-    char** cmd = (char**)malloc(sizeof(char*) * (MAXARGS + 1));
-    if (cmd == NULL) {
-        perror("malloc failed");
-        exit(1);
-    }
-    for(int j = 0; j < MAXARGS + 1; j++) {
-        cmd[j] = (char*)malloc(sizeof(char) * ARGLEN);
-        if (cmd[j] == NULL) {
-            perror("malloc failed");
-            exit(1);
+char* get_var(const char* name, VarTable* vars) {
+    Var* var = find_var(name, strlen(name), vars);
+    return var != NULL ? var->value : NULL;
+}
+
+void list_vars(VarTable* vars, Out* out) {
+    for (int i = 0; i < vars->size; i++) {
+        if (vars->slots[i].name != NULL) {
+            out_printf(out, "%s=%s\n", vars->slots[i].name, vars->slots[i].value);
         }
-        bzero(cmd[j], ARGLEN);
     }
-    if(cmdline[0] == '\0') return NULL;
-
-    int argnum = 0;
-    char* cp = cmdline;
-    char* start;
-    int len;
+}
 
-    while(*cp != '\0') {
-        while(*cp == ' ' || *cp == '\t') cp++;
-        start = cp;
-        len = 1;
-        while(*++cp != '\0' && !(*cp == ' ' || *cp == '\t')) len++;
-        strncpy(cmd[argnum], start, len);
-        cmd[argnum][len] = '\0';
-        argnum++;
-    }
-    cmd[argnum] = NULL;
-    return cmd;
-}
-
-// Read command input from user
-char* read_cmd(char* prompt, FILE* fp) {
-    printf("%s", prompt);
-    int c, pos = 0;
-    char* cmdline = (char*) malloc(sizeof(char) * MAX_LEN);
-    if (cmdline == NULL) {
+// Bring exec_env up to date and return it. Entries of environ that an exported variable
+// overrides are left out. Pointers and strings share one allocation.
+char** update_env(VarTable* vars) {
+    if (exec_env != NULL && env_built_generation == env_generation) {
+        return exec_env;
+    }
+    size_t count = 0, bytes = 0;
+    for (char** ep = environ; *ep != NULL; ep++) {
+        char* eq = strchr(*ep, '=');
+        Var* var = eq ? find_var(*ep, eq - *ep, vars) : NULL;
+        if (var == NULL || !var->global) {
+            count++;
+            bytes += strlen(*ep) + 1;
+        }
+    }
+    for (int i = 0; i < vars->size; i++) {
+        if (vars->slots[i].name != NULL && vars->slots[i].global) {
+            count++;
+            bytes += strlen(vars->slots[i].name) + strlen(vars->slots[i].value) + 2;
+        }
+    }
+
+    free(exec_env);
+    exec_env = xmalloc((count + 1) * sizeof(char*) + bytes);
+    char* dst = (char*)(exec_env + count + 1);
+    size_t n = 0;
+    for (char** ep = environ; *ep != NULL; ep++) {
+        char* eq = strchr(*ep, '=');
+        Var* var = eq ? find_var(*ep, eq - *ep, vars) : NULL;
+        if (var == NULL || !var->global) {
+            size_t len = strlen(*ep) + 1;
+            exec_env[n++] = memcpy(dst, *ep, len);
+            dst += len;
+        }
+    }
+    for (int i = 0; i < vars->size; i++) {
+        Var* var = &vars->slots[i];
+        if (var->name != NULL && var->global) {
+            exec_env[n++] = dst;
+            dst += sprintf(dst, "%s=%s", var->name, var->value) + 1;
+        }
+    }
+    exec_env[n] = NULL;
+    env_built_generation = env_generation;
+    env_rebuilds++;
+    return exec_env;
+}
+
+// Length of the variable name at the start of p, 0 if there is none
+size_t name_length(const char* p) {
+    size_t len = 0;
+    if (!(p[0] == '_' || (p[0] >= 'A' && p[0] <= 'Z') || (p[0] >= 'a' && p[0] <= 'z'))) return 0;
+    while (p[len] == '_' || (p[len] >= 'A' && p[len] <= 'Z') || (p[len] >= 'a' && p[len] <= 'z') ||
+           (p[len] >= '0' && p[len] <= '9')) {
+        len++;
+    }
+    return len;
+}
+
+// NAME=value as typed: the name part is never quoted
+int is_assignment(const char* word) {
+    size_t len = name_length(word);
+    return len > 0 && word[len] == '=';
+}
+
+int assignments_only(char* words[]) {
+    for (int i = 0; words[i] != NULL; i++) {
+        if (!is_assignment(words[i])) return 0;
+    }
+    return 1;
+}
+
+// A command made only of NAME=value words sets those variables, values expanded.
+// NAME=$((expr)) stores the result as an integer.
+int assign_vars(char* words[], Shell* sh) {
+    if (!assignments_only(words)) return 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        size_t len = name_length(words[i]);
+        char* expr = arith_word(words[i] + len + 1);
+        long num;
+        if (expr != NULL) {
+            if (arith_eval(expr, &num, sh->vars) != 0) {
+                expansion_failed = 1;
+            } else {
+                set_var_num(words[i], len, num, sh->vars);
+            }
+            continue;
+        }
+        char* value = expand_word(words[i] + len + 1, &cmd_arena, sh->vars);
+        set_var_value(words[i], len, value != NULL ? value : "", 0, sh->vars);
+    }
+    // HISTSIZE=n resizes the history ring
+    char* histsize = get_var("HISTSIZE", sh->vars);
+    if (histsize != NULL && atol(histsize) > 0 && atol(histsize) != sh->history->capacity) {
+        history_resize(sh->history, atol(histsize));
+    }
+    return 1;
+}
+
+// Builtin registry. Lookup hashes the name once into builtin_slots, so the cost of telling
+// an external command from a builtin does not grow with the number of builtins.
+const Builtin builtins[] = {
+    { "alias",   builtin_alias,   BUILTIN_STATE, "alias [name=command]: Define an alias, or list them" },
+    { "[",       builtin_test,    BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "[ expression ]: Same as test" },
+    { "batch",   builtin_batch,   BUILTIN_PIPELINE | BUILTIN_SUBSHELL | BUILTIN_STDIN, "batch [-j jobs] [-n max] command [fixed...] [-- item...]: Run command over the items in chunks that fit ARG_MAX" },
+    { "break",   builtin_break,   BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "break [n]: Leave the innermost n loops" },
+    { "cd",      builtin_cd,      BUILTIN_STATE, "cd <directory>: Change the working directory" },
+    { "continue", builtin_break,  BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "continue [n]: Start the next pass of the nth enclosing loop" },
+    { "echo",    builtin_echo,    BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "echo [-neE] [arg...]: Print the arguments" },
+    { "exit",    builtin_exit,    BUILTIN_STATE, "exit [n]: Terminate the shell" },
+    { "false",   builtin_false,   BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "false: Return failure" },
+    { "export",  builtin_export,  BUILTIN_STATE, "export name=value: Set a variable and pass it to commands" },
+    { "hash",    builtin_hash,    BUILTIN_PIPELINE | BUILTIN_SUBSHELL | BUILTIN_STATE, "hash [-r] [name...]: Show, clear or fill the command location cache" },
+    { "help",    builtin_help,    BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "help: List available built-in commands and their syntax" },
+    { "history", builtin_history, BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "history [n]: List the last n commands" },
+    { "jobs",    builtin_jobs,    BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "jobs [-l | -p]: List background jobs" },
+    { "kill",    builtin_kill,    BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "kill [-signal] job...: Signal every process of background jobs, SIGKILL by default" },
+    { "let",     builtin_let,     BUILTIN_PIPELINE | BUILTIN_SUBSHELL | BUILTIN_STATE, "let expression...: Evaluate arithmetic; fails if the last result is 0" },
+    { "printf",  builtin_printf,  BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "printf format [arg...]: Print formatted arguments" },
+    { "pwd",     builtin_pwd,     BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "pwd: Print the working directory" },
+    { "set",     builtin_set,     BUILTIN_PIPELINE | BUILTIN_SUBSHELL | BUILTIN_STATE, "set [name=value | -o [option=value]]: Set a variable or shell option, or list them" },
+    { "stats",   builtin_stats,   BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "stats: Show allocation, cache and environment counters" },
+    { "tee",     builtin_tee,     BUILTIN_PIPELINE | BUILTIN_SUBSHELL | BUILTIN_STDIN, "tee [-a] [file...]: Copy standard input to standard output and files" },
+    { "test",    builtin_test,    BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "test expression: Evaluate a condition" },
+    { "true",    builtin_true,    BUILTIN_PIPELINE | BUILTIN_SUBSHELL, "true: Return success" },
+    { "unalias", builtin_unalias, BUILTIN_STATE, "unalias <name>: Remove an alias" },
+    { "wait",    builtin_wait,    BUILTIN_STATE, "wait [job...]: Wait for background jobs, all of them including queued ones by default" },
+};
+#define NUM_BUILTINS (int)(sizeof(builtins) / sizeof(builtins[0]))
+
+// Open-addressed index into builtins[]: slot holds index + 1, 0 when empty
+unsigned char builtin_slots[BUILTIN_SLOTS];
+int builtins_ready = 0;
+
+void builtin_init() {
+    for (int i = 0; i < NUM_BUILTINS; i++) {
+        unsigned long h = hash_str(builtins[i].name) & (BUILTIN_SLOTS - 1);
+        while (builtin_slots[h] != 0) h = (h + 1) & (BUILTIN_SLOTS - 1);
+        builtin_slots[h] = i + 1;
+    }
+    builtins_ready = 1;
+}
+
+const Builtin* find_builtin(const char* name) {
+    if (!builtins_ready) builtin_init();
+    unsigned long h = hash_str(name) & (BUILTIN_SLOTS - 1);
+    while (builtin_slots[h] != 0) {
+        const Builtin* b = &builtins[builtin_slots[h] - 1];
+        if (strcmp(b->name, name) == 0) return b;
+        h = (h + 1) & (BUILTIN_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Run a builtin inside the shell with its output going to fd; returns its exit status
+int run_builtin(const Builtin* b, char* argv[], Shell* sh, int fd) {
+    Out out;
+    out_init(&out, fd);
+    int status = b->run(argv, sh, &out);
+    if (out_flush(&out) < 0) {
+        fprintf(stderr, "%s: write error: %s\n", argv[0], strerror(out.error));
+        return 1;
+    }
+    return status;
+}
+
+// Run a builtin as a pipeline stage or background job: a forked copy of the shell, no exec
+pid_t builtin_stage(const Builtin* b, char* argv[], Shell* sh, int in_fd, int out_fd, int close_fds[], int nclose) {
+    pid_t pid = fork();
+    if (pid == 0) {  // Child process
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        events_reset();
+        if (in_fd != -1) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != -1) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        for (int j = 0; j < nclose; j++) {
+            close(close_fds[j]);
+        }
+        _exit(run_builtin(b, argv, sh, STDOUT_FILENO));
+    } else if (pid < 0) {
+        perror("Fork failed");
+    }
+    return pid;
+}
+
+int builtin_alias(char* argv[], Shell* sh, Out* out) {
+    if (argv[1] != NULL) {
+        char* eq = strchr(argv[1], '=');
+        if (eq == NULL) {
+            out_puts(out, "Invalid alias format.\n");
+            return 1;
+        }
+        // argv may be the command tree's own words, so the name is copied out
+        char name[ARGLEN];
+        if (eq - argv[1] >= ARGLEN) {
+            out_puts(out, "Alias too long.\n");
+            return 1;
+        }
+        memcpy(name, argv[1], eq - argv[1]);
+        name[eq - argv[1]] = '\0';
+        set_alias(name, eq + 1, sh->aliases, sh->alias_count);
+    } else {
+        for (int i = 0; i < *sh->alias_count; i++) {
+            out_printf(out, "alias %s='%s'\n", sh->aliases[i].name, sh->aliases[i].command);
+        }
+    }
+    return 0;
+}
+
+int builtin_unalias(char* argv[], Shell* sh, Out* out) {
+    if (argv[1] == NULL) {
+        out_puts(out, "unalias: missing operand\n");
+        return 1;
+    }
+    remove_alias(argv[1], sh->aliases, sh->alias_count);
+    return 0;
+}
+
+int builtin_set(char* argv[], Shell* sh, Out* out) {
+    if (argv[1] != NULL && strcmp(argv[1], "-o") == 0) {
+        return set_option(argv[2], out);
+    } else if (argv[1] != NULL) {
+        set_var(argv[1], 0, sh->vars);
+    } else {
+        list_vars(sh->vars, out);
+    }
+    return 0;
+}
+
+// set -o: list the shell options; set -o name=value: change one
+int set_option(const char* opt, Out* out) {
+    if (opt == NULL) {
+        if (pipe_size > 0) {
+            out_printf(out, "pipesize\t%ld\n", pipe_size);
+        } else {
+            out_puts(out, "pipesize\tdefault\n");
+        }
+        if (max_jobs > 0) {
+            out_printf(out, "maxjobs\t%ld\n", max_jobs);
+        } else {
+            out_puts(out, "maxjobs\tunlimited\n");
+        }
+        return 0;
+    }
+    if (strncmp(opt, "pipesize=", 9) == 0) {
+        long size;
+        if (!parse_size(opt + 9, &size)) {
+            fprintf(stderr, "set: pipesize: invalid size: %s\n", opt + 9);
+            return 1;
+        }
+        pipe_size = size;
+        return 0;
+    }
+    if (strncmp(opt, "maxjobs=", 8) == 0) {
+        long n;
+        int error = 0;
+        if (strcmp(opt + 8, "unlimited") == 0) {
+            n = 0;
+        } else if (!test_number(opt + 8, &n, &error) || n < 0) {
+            fprintf(stderr, "set: maxjobs: invalid count: %s\n", opt + 8);
+            return 1;
+        }
+        max_jobs = n;
+        // A higher limit has room for jobs that are already waiting
+        jobs_start_queued();
+        return 0;
+    }
+    fprintf(stderr, "set: %s: invalid option\n", opt);
+    return 1;
+}
+
+// Parse a byte count with an optional K, M or G suffix (powers of 1024); "default" is 0
+int parse_size(const char* str, long* size) {
+    char* end;
+    if (strcmp(str, "default") == 0) {
+        *size = 0;
+        return 1;
+    }
+    errno = 0;
+    long n = strtol(str, &end, 10);
+    if (end == str || n < 0 || errno != 0) return 0;
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+    }
+    if (*end != '\0' || n > INT_MAX) return 0;
+    *size = n;
+    return 1;
+}
+
+int builtin_export(char* argv[], Shell* sh, Out* out) {
+    if (argv[1] == NULL) {
+        out_puts(out, "export: missing operand\n");
+        return 1;
+    }
+    set_var(argv[1], 1, sh->vars);
+    return 0;
+}
+
+int builtin_cd(char* argv[], Shell* sh, Out* out) {
+    if (argv[1] == NULL) {
+        fprintf(stderr, "cd: expected argument\n");
+        return 1;
+    }
+    if (chdir(argv[1]) != 0) {
+        perror("chdir failed");
+        return 1;
+    }
+    return 0;
+}
+
+int builtin_exit(char* argv[], Shell* sh, Out* out) {
+    exit(argv[1] != NULL ? atoi(argv[1]) : last_status);
+}
+
+int builtin_history(char* argv[], Shell* sh, Out* out) {
+    list_history(sh->history, argv[1] != NULL ? atol(argv[1]) : 0, out);
+    return 0;
+}
+
+int builtin_hash(char* argv[], Shell* sh, Out* out) {
+    return hash_builtin(argv, out);
+}
+
+int builtin_stats(char* argv[], Shell* sh, Out* out) {
+    print_stats(out);
+    return 0;
+}
+
+int builtin_help(char* argv[], Shell* sh, Out* out) {
+    out_puts(out, "Available built-in commands:\n");
+    for (int i = 0; i < NUM_BUILTINS; i++) {
+        out_printf(out, "%s\n", builtins[i].usage);
+    }
+    return 0;
+}
+
+int builtin_true(char* argv[], Shell* sh, Out* out) {
+    return 0;
+}
+
+int builtin_false(char* argv[], Shell* sh, Out* out) {
+    return 1;
+}
+
+// let expression...: each argument is one $(( )) expression, evaluated for its effect
+int builtin_let(char* argv[], Shell* sh, Out* out) {
+    long value = 0;
+    if (argv[1] == NULL) {
+        fprintf(stderr, "let: expression expected\n");
+        return 1;
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (arith_eval(argv[i], &value, sh->vars) != 0) return 1;
+    }
+    return value == 0;
+}
+
+// Inside a loop break and continue are compiled into jumps; this only runs outside one,
+// or with a count that is not a number as typed
+int builtin_break(char* argv[], Shell* sh, Out* out) {
+    if (argv[1] != NULL && (atol(argv[1]) < 1 || argv[1][strspn(argv[1], "0123456789")] != '\0')) {
+        fprintf(stderr, "%s: %s: loop count out of range\n", argv[0], argv[1]);
+        return 1;
+    }
+    fprintf(stderr, "%s: only meaningful in a loop\n", argv[0]);
+    return 0;
+}
+
+int builtin_pwd(char* argv[], Shell* sh, Out* out) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    out_printf(out, "%s\n", cwd);
+    return 0;
+}
+
+// echo [-neE] [arg...]: -n drops the newline, -e expands backslash escapes
+int builtin_echo(char* argv[], Shell* sh, Out* out) {
+    int newline = 1, escapes = 0;
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        const char* f = argv[i] + 1;
+        while (*f == 'n' || *f == 'e' || *f == 'E') f++;
+        if (*f != '\0') break;  // Not an option after all, print it
+        for (f = argv[i] + 1; *f; f++) {
+            if (*f == 'n') newline = 0;
+            else escapes = (*f == 'e');
+        }
+    }
+    for (int first = i; argv[i] != NULL; i++) {
+        if (i > first) out_write(out, " ", 1);
+        if (!escapes) {
+            out_puts(out, argv[i]);
+            continue;
+        }
+        for (const char* p = argv[i]; *p; ) {
+            const char* q = p;
+            while (*q && *q != '\\') q++;
+            out_write(out, p, q - p);
+            if (*q == '\0') break;
+            q++;
+            if (out_escape(out, &q)) return 0;  // \c: no more output
+            p = q;
+        }
+    }
+    if (newline) out_write(out, "\n", 1);
+    return 0;
+}
+
+// printf format [arg...]: %d %i %u %o %x %X %c %s %b %% with flags, width and precision.
+// The format is reused until every argument has been consumed.
+int builtin_printf(char* argv[], Shell* sh, Out* out) {
+    if (argv[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    char** args = argv + 2;
+    int status = 0;
+    int consumed;
+    do {
+        consumed = 0;
+        const char* p = argv[1];
+        while (*p) {
+            if (*p == '\\') {
+                p++;
+                if (out_escape(out, &p)) return status;
+                continue;
+            }
+            if (*p != '%') {
+                const char* q = p;
+                while (*q && *q != '%' && *q != '\\') q++;
+                out_write(out, p, q - p);
+                p = q;
+                continue;
+            }
+            if (p[1] == '%') {
+                out_write(out, "%", 1);
+                p += 2;
+                continue;
+            }
+
+            // Copy the conversion up to its letter, leaving room for an 'l' length modifier
+            char spec[32];
+            const char* start = p++;
+            while (*p && strchr("-+ #0", *p)) p++;
+            while (isdigit((unsigned char)*p)) p++;
+            if (*p == '.') {
+                p++;
+                while (isdigit((unsigned char)*p)) p++;
+            }
+            char conv = *p;
+            size_t n = p - start;
+            if (conv == '\0' || n > sizeof(spec) - 3) {
+                fprintf(stderr, "printf: %s: invalid format\n", start);
+                return 1;
+            }
+            p++;
+            memcpy(spec, start, n);
+            char* arg = *args;
+            if (arg != NULL) {
+                args++;
+                consumed = 1;
+            }
+
+            long num;
+            switch (conv) {
+            case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+                if (arg == NULL) {
+                    num = 0;
+                } else if (arg[0] == '\'' || arg[0] == '"') {
+                    num = (unsigned char)arg[1];  // 'c is the character's value
+                } else if (!test_number(arg, &num, &status)) {
+                    fprintf(stderr, "printf: %s: invalid number\n", arg);
+                }
+                spec[n] = 'l';
+                spec[n + 1] = conv;
+                spec[n + 2] = '\0';
+                out_printf(out, spec, num);
+                break;
+            case 'c':
+                if (arg != NULL && arg[0] != '\0') out_write(out, arg, 1);
+                break;
+            case 's':
+                spec[n] = 's';
+                spec[n + 1] = '\0';
+                out_printf(out, spec, arg != NULL ? arg : "");
+                break;
+            case 'b':
+                for (const char* b = arg != NULL ? arg : ""; *b; ) {
+                    if (*b != '\\') {
+                        out_write(out, b++, 1);
+                    } else {
+                        b++;
+                        if (out_escape(out, &b)) return status;
+                    }
+                }
+                break;
+            default:
+                fprintf(stderr, "printf: %%%c: invalid directive\n", conv);
+                return 1;
+            }
+        }
+    } while (consumed && *args != NULL);
+    return status;
+}
+
+// Parse a decimal (or 0x/0 prefixed) integer; on failure sets *error to 1 and returns 0
+int test_number(const char* str, long* value, int* error) {
+    char* end;
+    errno = 0;
+    *value = strtol(str, &end, 0);
+    while (*end == ' ' || *end == '\t') end++;
+    if (end == str || *end != '\0' || errno != 0) {
+        *value = 0;
+        *error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+// test / [: a recursive-descent evaluator for the POSIX expression grammar
+//   or: and (-o and)*   and: not (-a not)*   not: ! not | primary
+//   primary: ( or ) | unary-op arg | arg binary-op arg | arg
+// Each level returns the truth of what it consumed and sets *error on a syntax error.
+int test_or(char** argv, int* i, int argc, int* error) {
+    int value = test_and(argv, i, argc, error);
+    while (*i < argc && strcmp(argv[*i], "-o") == 0) {
+        (*i)++;
+        value = test_and(argv, i, argc, error) || value;
+    }
+    return value;
+}
+
+int test_and(char** argv, int* i, int argc, int* error) {
+    int value = test_not(argv, i, argc, error);
+    while (*i < argc && strcmp(argv[*i], "-a") == 0) {
+        (*i)++;
+        value = test_not(argv, i, argc, error) && value;
+    }
+    return value;
+}
+
+int test_not(char** argv, int* i, int argc, int* error) {
+    // A lone "!" is just a non-empty string
+    if (*i + 1 < argc && strcmp(argv[*i], "!") == 0) {
+        (*i)++;
+        return !test_not(argv, i, argc, error);
+    }
+    return test_primary(argv, i, argc, error);
+}
+
+int test_primary(char** argv, int* i, int argc, int* error) {
+    struct stat st;
+    if (*i >= argc) {
+        *error = 1;
+        return 0;
+    }
+    const char* a = argv[*i];
+
+    // Binary operators take precedence, so "-n = -n" compares strings
+    if (*i + 2 < argc) {
+        const char* op = argv[*i + 1];
+        const char* b = argv[*i + 2];
+        const char* intop = op[0] == '-' && strlen(op) == 3 ? strstr("-eq-ne-lt-le-gt-ge", op) : NULL;
+        long x, y;
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+            *i += 3;
+            return strcmp(a, b) == 0;
+        } else if (strcmp(op, "!=") == 0) {
+            *i += 3;
+            return strcmp(a, b) != 0;
+        } else if (intop != NULL) {
+            *i += 3;
+            if (!test_number(a, &x, error) || !test_number(b, &y, error)) {
+                fprintf(stderr, "test: integer expression expected\n");
+                return 0;
+            }
+            switch (op[1] << 8 | op[2]) {
+            case 'e' << 8 | 'q': return x == y;
+            case 'n' << 8 | 'e': return x != y;
+            case 'l' << 8 | 't': return x < y;
+            case 'l' << 8 | 'e': return x <= y;
+            case 'g' << 8 | 't': return x > y;
+            default: return x >= y;
+            }
+        } else if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0) {
+            struct stat sb;
+            *i += 3;
+            if (stat(a, &st) != 0) return op[1] == 'o' && stat(b, &sb) == 0;
+            if (stat(b, &sb) != 0) return op[1] == 'n';
+            return op[1] == 'n' ? st.st_mtime > sb.st_mtime : st.st_mtime < sb.st_mtime;
+        }
+    }
+
+    if (strcmp(a, "(") == 0 && *i + 1 < argc) {
+        (*i)++;
+        int value = test_or(argv, i, argc, error);
+        if (*i >= argc || strcmp(argv[*i], ")") != 0) {
+            *error = 1;
+            return 0;
+        }
+        (*i)++;
+        return value;
+    }
+
+    if (a[0] == '-' && a[1] != '\0' && a[2] == '\0' && *i + 1 < argc) {
+        const char* arg = argv[*i + 1];
+        int value;
+        switch (a[1]) {
+        case 'n': value = arg[0] != '\0'; break;
+        case 'z': value = arg[0] == '\0'; break;
+        case 'e': value = stat(arg, &st) == 0; break;
+        case 'f': value = stat(arg, &st) == 0 && S_ISREG(st.st_mode); break;
+        case 'd': value = stat(arg, &st) == 0 && S_ISDIR(st.st_mode); break;
+        case 'p': value = stat(arg, &st) == 0 && S_ISFIFO(st.st_mode); break;
+        case 'b': value = stat(arg, &st) == 0 && S_ISBLK(st.st_mode); break;
+        case 'c': value = stat(arg, &st) == 0 && S_ISCHR(st.st_mode); break;
+        case 'S': value = stat(arg, &st) == 0 && S_ISSOCK(st.st_mode); break;
+        case 's': value = stat(arg, &st) == 0 && st.st_size > 0; break;
+        case 'h': case 'L': value = lstat(arg, &st) == 0 && S_ISLNK(st.st_mode); break;
+        case 'r': value = access(arg, R_OK) == 0; break;
+        case 'w': value = access(arg, W_OK) == 0; break;
+        case 'x': value = access(arg, X_OK) == 0; break;
+        case 't': value = isatty(atoi(arg)); break;
+        default:
+            *error = 1;
+            fprintf(stderr, "test: %s: unary operator expected\n", a);
+            return 0;
+        }
+        *i += 2;
+        return value;
+    }
+
+    // A single argument is true when it is not empty
+    (*i)++;
+    return a[0] != '\0';
+}
+
+// Move len bytes from one fd to another, in the kernel with splice(2) where the fds allow it
+// (one end must be a pipe) and through a buffer otherwise. Returns 0, or -1 on an error.
+int move_bytes(int from, int to, size_t len) {
+    char buf[OUT_BUF_SIZE];
+    int use_splice = 1;
+    while (len > 0) {
+        ssize_t n;
+        if (use_splice) {
+            n = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINVAL) {
+                use_splice = 0;  // Not spliceable, e.g. an O_APPEND file or a terminal
+                continue;
+            }
+        } else {
+            n = read(from, buf, len < sizeof(buf) ? len : sizeof(buf));
+            if (n > 0) {
+                for (ssize_t done = 0, w; done < n; done += w) {
+                    while ((w = write(to, buf + done, n - done)) < 0 && errno == EINTR);
+                    if (w < 0) return -1;
+                }
+            }
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// tee [-a] [file...] without copying through user space. Each chunk of input is duplicated
+// with tee(2) into a private pipe per file and drained into the file with splice(2), then
+// spliced on to standard output. Input that is not a pipe (after `cat FILE | tee` became
+// `tee < FILE`) is first spliced into a staging pipe. The private pipes are as large as the
+// pipe they tee from, so one tee(2) always takes a whole chunk.
+int builtin_tee(char* argv[], Shell* sh, Out* out) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int i = 1, status = 0, nfiles = 0;
+    if (argv[i] != NULL && strcmp(argv[i], "-a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+        i++;
+    }
+    int argc = i;
+    while (argv[argc] != NULL) argc++;
+    int files[argc];
+    char* names[argc];
+    int pipes[argc][2];
+    for (; argv[i] != NULL; i++) {
+        int fd = open(argv[i], flags, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "tee: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        names[nfiles] = argv[i];
+        files[nfiles++] = fd;
+    }
+
+    struct stat st;
+    int src = STDIN_FILENO;
+    int stage[2] = { -1, -1 };
+    int zero_copy = fstat(STDIN_FILENO, &st) == 0;
+    if (zero_copy && !S_ISFIFO(st.st_mode)) {
+        zero_copy = pipe2(stage, O_CLOEXEC) == 0;
+        if (zero_copy) fcntl(stage[1], F_SETPIPE_SZ, TEE_CHUNK);
+        src = stage[0];
+    }
+    int pipe_size = zero_copy ? fcntl(src, F_GETPIPE_SZ) : -1;
+    int npipes = 0;
+    for (; zero_copy && npipes < nfiles; npipes++) {
+        if (pipe2(pipes[npipes], O_CLOEXEC) < 0) {
+            zero_copy = 0;
+            break;
+        }
+        if (fcntl(pipes[npipes][1], F_SETPIPE_SZ, pipe_size) < pipe_size) {
+            zero_copy = 0;
+        }
+    }
+
+    long total = 0;
+    while (zero_copy) {
+        ssize_t n;
+        if (stage[1] != -1) {
+            // Refill the staging pipe from the input file
+            while ((n = splice(STDIN_FILENO, NULL, stage[1], NULL, pipe_size, SPLICE_F_MOVE)) < 0 && errno == EINTR);
+        } else if (npipes > 0) {
+            // Peek at the next chunk by teeing it into the first file's pipe
+            while ((n = tee(src, pipes[0][1], TEE_CHUNK, 0)) < 0 && errno == EINTR);
+        } else {
+            // Nothing to duplicate: move whatever arrives straight through
+            while ((n = splice(src, NULL, out->fd, NULL, TEE_CHUNK, SPLICE_F_MOVE)) < 0 && errno == EINTR);
+        }
+        if (n < 0 && errno == EINVAL && total == 0) {
+            zero_copy = 0;  // Not spliceable, e.g. a terminal
+            break;
+        }
+        if (n <= 0) {
+            if (n < 0) status = 1;
+            break;
+        }
+        total += n;
+        if (stage[1] == -1 && npipes == 0) continue;
+
+        int f;
+        for (f = 0; f < npipes; f++) {
+            ssize_t m = n;
+            if (f > 0 || stage[1] != -1) {
+                while ((m = tee(src, pipes[f][1], n, 0)) < 0 && errno == EINTR);
+            }
+            if (m != n || move_bytes(pipes[f][0], files[f], n) < 0) break;
+        }
+        if (f < npipes) {
+            fprintf(stderr, "tee: %s: write error\n", names[f]);
+            status = 1;
+            break;
+        }
+        if (move_bytes(src, out->fd, n) < 0) {
+            status = 1;
+            break;
+        }
+    }
+    for (int f = 0; f < npipes; f++) {
+        close(pipes[f][0]);
+        close(pipes[f][1]);
+    }
+    if (stage[0] != -1) {
+        close(stage[0]);
+        close(stage[1]);
+    }
+
+    if (!zero_copy) {
+        // A terminal, or pipes the kernel would not resize: copy through a buffer
+        char buf[OUT_BUF_SIZE];
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                status = 1;
+                break;
+            }
+            out_write(out, buf, n);
+            out_flush(out);
+            for (int f = 0; f < nfiles; f++) {
+                if (write(files[f], buf, n) != n) {
+                    fprintf(stderr, "tee: %s: write error\n", names[f]);
+                    status = 1;
+                }
+            }
+        }
+    }
+    for (int f = 0; f < nfiles; f++) {
+        close(files[f]);
+    }
+    return status;
+}
+
+// test expression / [ expression ]: status 0 if true, 1 if false, 2 on a usage error
+int builtin_test(char* argv[], Shell* sh, Out* out) {
+    int argc = 0;
+    while (argv[argc] != NULL) argc++;
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        argc--;
+    }
+    if (argc == 1) return 1;  // No expression is false
+
+    int i = 1, error = 0;
+    int value = test_or(argv, &i, argc, &error);
+    if (error || i != argc) {
+        if (!error || i != argc) fprintf(stderr, "%s: syntax error\n", argv[0]);
+        return 2;
+    }
+    return value ? 0 : 1;
+}
+
+void out_init(Out* out, int fd) {
+    out->fd = fd;
+    out->error = 0;
+    out->sink = NULL;
+    out->len = 0;
+}
+
+int out_flush(Out* out) {
+    if (out->sink != NULL) {
+        sb_put(out->sink, out->buf, out->len);
+        out->len = 0;
+        return 0;
+    }
+    // Anything the shell itself printed comes first
+    if (out->fd == STDOUT_FILENO) {
+        fflush(stdout);
+    }
+    size_t done = 0;
+    while (done < out->len && out->error == 0) {
+        ssize_t n = write(out->fd, out->buf + done, out->len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            out->error = errno;
+        } else {
+            done += n;
+        }
+    }
+    out->len = 0;
+    return out->error ? -1 : 0;
+}
+
+void out_write(Out* out, const char* data, size_t len) {
+    while (len > 0) {
+        if (out->len == OUT_BUF_SIZE) {
+            out_flush(out);
+        }
+        size_t n = OUT_BUF_SIZE - out->len < len ? OUT_BUF_SIZE - out->len : len;
+        memcpy(out->buf + out->len, data, n);
+        out->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void out_puts(Out* out, const char* str) {
+    out_write(out, str, strlen(str));
+}
+
+void out_printf(Out* out, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out->buf + out->len, OUT_BUF_SIZE - out->len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n < OUT_BUF_SIZE - out->len) {
+        if (n > 0) out->len += n;
+        return;
+    }
+    // Did not fit in what is left of the buffer: format into the arena and copy
+    char* tmp = arena_alloc(&cmd_arena, n + 1);
+    va_start(ap, fmt);
+    vsnprintf(tmp, n + 1, fmt, ap);
+    va_end(ap);
+    out_write(out, tmp, n);
+}
+
+// Write the backslash escape at *p (just past the backslash) and advance past it.
+// Returns 1 for \c, which ends all output of echo and printf.
+int out_escape(Out* out, const char** p) {
+    const char* s = *p;
+    char c;
+    switch (*s) {
+    case 'n': c = '\n'; break;
+    case 't': c = '\t'; break;
+    case 'r': c = '\r'; break;
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'f': c = '\f'; break;
+    case 'v': c = '\v'; break;
+    case 'e': c = 27; break;
+    case '\\': c = '\\'; break;
+    case 'c':
+        *p = s + 1;
+        return 1;
+    case '\0':
+        out_write(out, "\\", 1);
+        return 0;
+    default:
+        if (*s >= '0' && *s <= '7') {
+            // Up to three octal digits, after an optional leading 0 as echo writes them
+            int v = 0, digits = 0;
+            if (*s == '0') s++;
+            while (digits < 3 && *s >= '0' && *s <= '7') {
+                v = v * 8 + (*s++ - '0');
+                digits++;
+            }
+            c = (char)v;
+            out_write(out, &c, 1);
+            *p = s;
+            return 0;
+        }
+        out_write(out, "\\", 1);
+        c = *s;
+    }
+    out_write(out, &c, 1);
+    *p = s + 1;
+    return 0;
+}
+
+// Walk the command tree and return the status of what ran last. last is set when nothing
+// runs after node in this shell, so a final external command may exec in place. $? is
+// updated after every pipeline, for the commands after it on the same line.
+int exec_node(Node* node, Shell* sh, int last) {
+    int status = 0;
+    switch (node->type) {
+    case NODE_AND:
+    case NODE_OR:
+        status = exec_node(node->kids, sh, 0);
+        if ((status == 0) == (node->type == NODE_AND)) {
+            status = exec_node(node->kids->next, sh, last);
+        }
+        return status;
+    case NODE_LIST:
+        for (Node* item = node->kids; item != NULL; item = item->next) {
+            if (item->flags & NODE_BACKGROUND) {
+                status = last_status = execute(item, sh, 0, 1);
+            } else {
+                status = exec_node(item, sh, last && item->next == NULL);
+            }
+        }
+        return status;
+    case NODE_IF:
+    case NODE_WHILE:
+    case NODE_FOR:
+        // Compiled and run by the VM; with redirections through execute(), like a group
+        if (node->redirs == NULL) return run_code(node, sh);
+        return last_status = execute(node, sh, 0, 0);
+    default:
+        status = execute(node, sh, last && !(node->flags & NODE_NEGATE), 0);
+        if (node->flags & NODE_NEGATE) status = !status;
+        return last_status = status;
+    }
+}
+
+// Run one pipeline, or a lone command, subshell or group, and return its status. Every
+// stage is expanded and its redirections opened first; then builtins, assignments and
+// groups run inside the shell where they can and the rest is launched as one job.
+// A background node is any list item followed by &: and-or lists become a forked stage.
+int execute(Node* node, Shell* sh, int last, int background) {
+    int num_cmds = node->type == NODE_PIPE ? node->n : 1;
+    Node* first = node->type == NODE_PIPE ? node->kids : node;
+    int i, status = 0;
+    pid_t pid;  // Declare pid here to capture the last command’s pid for background jobs
+
+    // Assignments, groups, ifs and loops change the shell itself, so in the foreground they
+    // never fork
+    expansion_failed = 0;
+    subst_status = 0;
+    if (num_cmds == 1 && !background) {
+        if (first->type == NODE_GROUP || first->type == NODE_IF || first->type == NODE_WHILE || first->type == NODE_FOR) {
+            return exec_group(first, sh, last);
+        }
+        if (first->type == NODE_CMD && first->redirs == NULL && assign_vars(first->words, sh)) {
+            return expansion_failed ? 1 : subst_status;
+        }
+    }
+
+    Stage* stages = arena_alloc(&cmd_arena, sizeof(Stage) * num_cmds);
+    pid_t* pids = arena_alloc(&cmd_arena, sizeof(pid_t) * num_cmds);
+    Node* kid = first;
+    for (i = 0; i < num_cmds; i++, kid = kid->next) {
+        Stage* s = &stages[i];
+        s->argv = NULL;
+        s->body = NULL;
+        if (kid->type == NODE_CMD) {
+            s->argv = kid->flags & NODE_PLAIN ? kid->words : expand_words(kid->words, kid->n, &cmd_arena, sh->vars);
+            // Assignments in a pipeline or the background only reach a subshell
+            if (assignments_only(kid->words)) {
+                s->body = kid;
+            }
+        } else {
+            s->body = kid;
+        }
+        if (open_redirs(kid->redirs, &s->in, &s->out, sh->vars) != 0) {
+            close_stages(stages, i);
+            return 1;
+        }
+    }
+    if (expansion_failed) {
+        close_stages(stages, num_cmds);
+        return 1;
+    }
+    // Only redirections, or words that all expanded to nothing: the files are made, no more
+    if (num_cmds == 1 && stages[0].body == NULL && stages[0].argv[0] == NULL) {
+        close_stages(stages, 1);
+        return 0;
+    }
+
+    // pipesize SIZE a | b ...: pipe capacity for this pipeline only
+    long pipe_bytes = pipe_size;
+    char** argv = stages[0].argv;
+    if (argv != NULL && argv[0] != NULL && strcmp(argv[0], "pipesize") == 0) {
+        if (argv[1] == NULL || !parse_size(argv[1], &pipe_bytes)) {
+            fprintf(stderr, "pipesize: usage: pipesize SIZE command [| command...]\n");
+            close_stages(stages, num_cmds);
+            return 2;
+        }
+        stages[0].argv += 2;
+    }
+    num_cmds = elide_cat(stages, num_cmds);
+    argv = stages[0].argv;
+
+    // A lone builtin in the foreground runs inside the shell and writes straight to its
+    // redirection. In the background it runs in a forked subshell like any other job, so
+    // exit, cd or wait there cannot touch the shell itself.
+    const Builtin* builtin = argv != NULL && argv[0] != NULL ? find_builtin(argv[0]) : NULL;
+    if (num_cmds == 1 && builtin != NULL && !(builtin->flags & BUILTIN_STDIN) && !background) {
+        status = run_builtin(builtin, argv, sh, stages[0].out != -1 ? stages[0].out : STDOUT_FILENO);
+        close_stages(stages, 1);
+        return status;
+    }
+
+    // Children get the cached environment
+    update_env(sh->vars);
+
+    // set -o maxjobs=N: a background job past the limit waits for a slot
+    if (background && max_jobs > 0 && bg_running >= max_jobs) {
+        Job* job = job_queue(stages, num_cmds, pipe_bytes, node->text, sh);
+        printf("[%d] queued\n", job->id);
+        return 0;
+    }
+
+    // batch [-j N] [-n N] cmd ...: split an oversized argument list over several invocations
+    if (num_cmds == 1 && argv != NULL && argv[0] != NULL && strcmp(argv[0], "batch") == 0) {
+        if (!background) {
+            status = run_batch(argv, stages[0].in, stages[0].out, sh);
+        } else if ((pid = batch_stage(argv, stages[0].in, stages[0].out, sh)) > 0) {
+            Job* job = job_create(&pid, 1, node->text, 1);
+            printf("[%d] %d\n", job->id, pid);
+        }
+        close_stages(stages, 1);
+        return status;
+    }
+
+    // Final command of a -c string: redirect and exec in place, nothing left to return to
+    if (last && num_cmds == 1 && !background && argv != NULL && argv[0] != NULL && builtin == NULL) {
+        if (stages[0].in != -1) {
+            dup2(stages[0].in, STDIN_FILENO);
+            close(stages[0].in);
+        }
+        if (stages[0].out != -1) {
+            dup2(stages[0].out, STDOUT_FILENO);
+            close(stages[0].out);
+        }
+        fflush(stdout);
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        char* path = hash_lookup(argv[0]);
+        if (path != NULL) {
+            execve(path, argv, exec_env);
+        } else {
+            errno = ENOENT;
+        }
+        fprintf(stderr, "%s: Command Not Found: %s\n", argv[0], strerror(errno));
+        exit(127);
+    }
+
+    // Launch every stage of the pipeline
+    int launched = launch_pipeline(stages, num_cmds, pids, sh, pipe_bytes);
+    close_stages(stages, num_cmds);
+    if (launched == 0) {
+        return 127;
+    }
+    Job* job = job_create(pids, num_cmds, background ? node->text : NULL, background);
+
+    // If in the foreground, wait for all commands to complete; the last stage gives the status
+    if (!background) {
+        status = job_wait(job);
+        job_free(job);
+    } else {
+        printf("[%d] %d\n", job->id, pids[num_cmds - 1]);  // Print job number and PID for the last background process
+    }
+
+    return status;
+}
+
+// { list; } runs in the shell itself, so cd and assignments inside it stick, and so do if
+// and loops. Its redirections are put on stdin/stdout for the duration and the shell's own
+// put back.
+int exec_group(Node* node, Shell* sh, int last) {
+    int in, out;
+    int saved_in = -1, saved_out = -1;
+    if (open_redirs(node->redirs, &in, &out, sh->vars) != 0) return 1;
+    fflush(stdout);
+    if (in != -1) {
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(in, STDIN_FILENO);
+        close(in);
+    }
+    if (out != -1) {
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(out, STDOUT_FILENO);
+        close(out);
+    }
+    int status = node->type == NODE_GROUP ? exec_node(node->kids, sh, last) : run_code(node, sh);
+    fflush(stdout);
+    if (saved_in != -1) {
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+    if (saved_out != -1) {
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    return status;
+}
+
+// Run a compound command as a pipeline stage or background job: a forked copy of the
+// shell walks the tree, and its final external command replaces it. The redirections of a
+// subshell or group are already in place, so only what is inside them runs.
+pid_t subshell_stage(Node* body, Shell* sh, int in_fd, int out_fd, int close_fds[], int nclose) {
+    pid_t pid = fork();
+    if (pid == 0) {  // Child process; SIGCHLD stays blocked, it is a shell too
+        events_reset();
+        if (in_fd != -1) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != -1) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        for (int j = 0; j < nclose; j++) {
+            close(close_fds[j]);
+        }
+        int status = 0;
+        if (body->type == NODE_SUBSHELL || body->type == NODE_GROUP) {
+            status = exec_node(body->kids, sh, 1);
+        } else if (body->type == NODE_IF || body->type == NODE_WHILE || body->type == NODE_FOR) {
+            status = run_code(body, sh);
+        } else if (body->type != NODE_CMD) {  // A simple command here is only assignments
+            status = exec_node(body, sh, 1);
+        }
+        fflush(stdout);
+        _exit(status);
+    } else if (pid < 0) {
+        perror("Fork failed");
+    }
+    return pid;
+}
+
+// Open a command's redirections in order, the last one for each fd winning. Targets are
+// expanded like words and must come to exactly one. Returns 0, or 1 after reporting the
+// failure with nothing left open.
+int open_redirs(Redir* r, int* in, int* out, VarTable* vars) {
+    *in = *out = -1;
+    for (; r != NULL; r = r->next) {
+        char* path = expand_word(r->word, &cmd_arena, vars);
+        if (path == NULL) {
+            fprintf(stderr, "%s: ambiguous redirect\n", r->word);
+        } else {
+            int fd = r->fd == 0 ? open(path, O_RDONLY | O_CLOEXEC)
+                                : open(path, O_WRONLY | O_CREAT | (r->append ? O_APPEND : O_TRUNC) | O_CLOEXEC, 0644);
+            if (fd >= 0) {
+                int* target = r->fd == 0 ? in : out;
+                if (*target != -1) close(*target);
+                *target = fd;
+                continue;
+            }
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        }
+        if (*in != -1) close(*in);
+        if (*out != -1) close(*out);
+        *in = *out = -1;
+        return 1;
+    }
+    return 0;
+}
+
+// Close the redirections of stages that have been launched or given up on
+void close_stages(Stage stages[], int n) {
+    for (int i = 0; i < n; i++) {
+        if (stages[i].in != -1) close(stages[i].in);
+        if (stages[i].out != -1) close(stages[i].out);
+        stages[i].in = stages[i].out = -1;
+    }
+}
+
+// Compile an if, while, until or for statement into code for the VM and run it. The code
+// is built afresh in the command arena whenever the statement starts; its loops then run
+// without going back to the tree. Its own redirections are already in place.
+int run_code(Node* node, Shell* sh) {
+    Code code = { NULL, 0, 0, 0, NULL };
+    compile_compound(&code, node);
+    emit(&code, OP_END, NULL);
+    return vm_run(&code, sh);
+}
+
+// Append an instruction and return its index; instructions move as the code grows
+int emit(Code* code, int op, Node* node) {
+    if (code->len == code->cap) {
+        int cap = code->cap > 0 ? code->cap * 2 : 32;
+        Instr* grown = arena_alloc(&cmd_arena, sizeof(Instr) * cap);
+        if (code->len > 0) memcpy(grown, code->instrs, sizeof(Instr) * code->len);
+        code->instrs = grown;
+        code->cap = cap;
+    }
+    Instr* in = &code->instrs[code->len];
+    memset(in, 0, sizeof(Instr));
+    in->op = op;
+    in->arg = -1;
+    in->node = node;
+    return code->len++;
+}
+
+// Point every jump of a chain linked through arg at target
+void patch(Code* code, int chain, int target) {
+    while (chain != -1) {
+        int next = code->instrs[chain].arg;
+        code->instrs[chain].arg = target;
+        chain = next;
+    }
+}
+
+// Lists, && and ||, if and loops become jumps; groups without redirections are inlined.
+// Everything else is one instruction running the node.
+void compile_node(Code* code, Node* node) {
+    int jump;
+    switch (node->type) {
+    case NODE_CMD:
+        compile_command(code, node);
+        return;
+    case NODE_LIST:
+        for (Node* item = node->kids; item != NULL; item = item->next) {
+            if (item->flags & NODE_BACKGROUND) {
+                emit(code, OP_BACKGROUND, item);
+            } else {
+                compile_node(code, item);
+            }
+        }
+        return;
+    case NODE_AND:
+    case NODE_OR:
+        compile_node(code, node->kids);
+        jump = emit(code, node->type == NODE_AND ? OP_JUMP_FALSE : OP_JUMP_TRUE, NULL);
+        compile_node(code, node->kids->next);
+        code->instrs[jump].arg = code->len;
+        return;
+    case NODE_PIPE:
+        if (node->n == 1) {  // ! cmd
+            compile_node(code, node->kids);
+            emit(code, OP_NOT, NULL);
+            return;
+        }
+        break;
+    case NODE_GROUP:
+        if (node->redirs == NULL) {
+            compile_node(code, node->kids);
+            return;
+        }
+        break;
+    case NODE_IF:
+    case NODE_WHILE:
+    case NODE_FOR:
+        if (node->redirs == NULL) {
+            compile_compound(code, node);
+            return;
+        }
+        break;
+    }
+    emit(code, OP_EXEC, node);
+}
+
+// if, while, until and for, without their redirections
+void compile_compound(Code* code, Node* node) {
+    int jump, top, slot, init, back, done;
+    LoopCtx loop;
+    if (node->type == NODE_IF) {
+        // Status is 0 when no branch runs
+        compile_node(code, node->kids);
+        jump = emit(code, OP_JUMP_FALSE, NULL);
+        compile_node(code, node->kids->next);
+        top = emit(code, OP_JUMP, NULL);
+        code->instrs[jump].arg = code->len;
+        if (node->kids->next->next != NULL) {
+            compile_node(code, node->kids->next->next);
+        } else {
+            done = emit(code, OP_STATUS, NULL);
+            code->instrs[done].arg = 0;
+        }
+        code->instrs[top].arg = code->len;
+        return;
+    }
+    // while: init, top: condition, exit test, body, loop to top
+    // for:   init, top: next word or exit, body, loop to top
+    // A loop's status is its last pass's, 0 if it made none; break jumps past that
+    slot = code->loops++;
+    loop = (LoopCtx){ slot, -1, -1, code->loop };
+    if (node->type == NODE_WHILE) {
+        init = emit(code, OP_LOOP_INIT, NULL);
+        top = code->len;
+        compile_node(code, node->kids);
+        jump = emit(code, node->flags & NODE_UNTIL ? OP_JUMP_TRUE : OP_JUMP_FALSE, NULL);
+        code->loop = &loop;
+        compile_node(code, node->kids->next);
+    } else {
+        init = emit(code, OP_FOR_INIT, node);
+        top = jump = emit(code, OP_FOR_NEXT, NULL);
+        code->instrs[jump].var = var_ref_new(node->words[0], strlen(node->words[0]));
+        code->loop = &loop;
+        compile_node(code, node->kids);
+    }
+    code->loop = loop.outer;
+    patch(code, loop.continues, code->len);
+    back = emit(code, OP_LOOP, NULL);
+    code->instrs[back].arg = top;
+    code->instrs[jump].arg = code->len;
+    done = emit(code, OP_LOOP_STATUS, NULL);
+    code->instrs[init].slot = code->instrs[jump].slot = code->instrs[back].slot = code->instrs[done].slot = slot;
+    patch(code, loop.breaks, code->len);
+}
+
+// Simple commands the shell runs itself get their own instructions: assignments of a
+// constant, of one variable or of one $(( )), true and false, break and continue, and builtins without
+// redirections. Anything else goes through exec_node() and execute() as on its own.
+void compile_command(Code* code, Node* node) {
+    char** words = node->words;
+    Word w;
+    int k;
+    if (node->redirs != NULL || node->n == 0) {
+        emit(code, OP_EXEC, node);
+        return;
+    }
+    if (assignments_only(words)) {
+        size_t len = name_length(words[0]);
+        char* value = words[0] + len + 1;
+        const char* from;
+        size_t from_len;
+        char* expr;
+        // HISTSIZE takes effect through assign_vars()
+        if (node->n > 1 || (len == 8 && memcmp(words[0], "HISTSIZE", 8) == 0)) {
+            emit(code, OP_ASSIGN, node);
+        } else if ((expr = arith_word(value)) != NULL) {
+            k = emit(code, OP_ARITH, node);
+            code->instrs[k].var = var_ref_new(words[0], len);
+            code->instrs[k].value = expr;
+        } else if (strpbrk(value, EXPAND_CHARS) == NULL) {
+            k = emit(code, OP_SET, node);
+            code->instrs[k].var = var_ref_new(words[0], len);
+            code->instrs[k].value = value;
+        } else if ((from_len = var_ref_name(value, &from)) > 0) {
+            k = emit(code, OP_COPY, node);
+            code->instrs[k].var = var_ref_new(words[0], len);
+            code->instrs[k].from = var_ref_new(from, from_len);
+        } else if (compile_word(&w, value)) {
+            k = emit(code, OP_CONCAT, node);
+            code->instrs[k].var = var_ref_new(words[0], len);
+            code->instrs[k].words = arena_alloc(&cmd_arena, sizeof(Word));
+            code->instrs[k].words[0] = w;
+        } else {
+            emit(code, OP_ASSIGN, node);
+        }
+        return;
+    }
+    const Builtin* b = strpbrk(words[0], EXPAND_CHARS) == NULL ? find_builtin(words[0]) : NULL;
+    if (b == NULL || (b->flags & BUILTIN_STDIN)) {
+        emit(code, OP_EXEC, node);
+    } else if (b->run == builtin_break) {
+        compile_loop_exit(code, node);
+    } else if ((b->run == builtin_true || b->run == builtin_false) && node->n == 1) {
+        k = emit(code, OP_STATUS, node);
+        code->instrs[k].arg = b->run == builtin_false;
+    } else if (node->flags & NODE_PLAIN) {
+        k = emit(code, OP_BUILTIN, node);
+        code->instrs[k].builtin = b;
+    } else {
+        Word* compiled = arena_alloc(&cmd_arena, sizeof(Word) * node->n);
+        int n = 0;
+        while (n < node->n && compile_word(&compiled[n], words[n])) n++;
+        k = emit(code, n == node->n ? OP_BUILTIN_WORDS : OP_BUILTIN_EXPAND, node);
+        code->instrs[k].builtin = b;
+        code->instrs[k].words = n == node->n ? compiled : NULL;
+    }
+}
+
+// Compile a word into pieces if it is plain text and $NAME or ${NAME} references, bare or
+// all in double quotes; returns 0 for anything else
+int compile_word(Word* w, const char* word) {
+    size_t len = strlen(word);
+    w->quoted = len >= 2 && word[0] == '"' && word[len - 1] == '"';
+    if (w->quoted) {
+        word++;
+        len -= 2;
+    }
+    int refs = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (word[i] == '\'' || word[i] == '"' || word[i] == '\\' || word[i] == '`') return 0;
+        if (word[i] == '$') refs++;
+    }
+    w->pieces = arena_alloc(&cmd_arena, sizeof(Piece) * (2 * refs + 1));
+    w->n = 0;
+    size_t i = 0;
+    while (i < len) {
+        Piece* piece = &w->pieces[w->n++];
+        if (word[i] != '$') {
+            size_t end = i;
+            while (end < len && word[end] != '$') end++;
+            piece->text = arena_strndup(&cmd_arena, word + i, end - i);
+            piece->len = end - i;
+            piece->var = NULL;
+            i = end;
+            continue;
+        }
+        int brace = word[i + 1] == '{';
+        size_t name_len = name_length(word + i + 1 + brace);
+        if (name_len == 0 || (brace && word[i + 2 + name_len] != '}')) return 0;
+        piece->var = var_ref_new(word + i + 1 + brace, name_len);
+        i += 1 + name_len + 2 * brace;
+    }
+    return 1;
+}
+
+// Expand a compiled word like expand_word(): NULL when it is bare and comes out empty
+char* word_expand(Word* w, VarTable* vars) {
+    if (w->n == 1 && w->pieces[0].var == NULL) return w->pieces[0].text;
+    StrBuf b;
+    sb_init(&b, &cmd_arena, 64);
+    for (int i = 0; i < w->n; i++) {
+        Piece* piece = &w->pieces[i];
+        if (piece->var == NULL) {
+            sb_put(&b, piece->text, piece->len);
+            continue;
+        }
+        Var* var = var_ref_find(piece->var, vars);
+        const char* value = var != NULL ? var->value : getenv(piece->var->name);
+        if (value != NULL) sb_put(&b, value, strlen(value));
+    }
+    if (b.len == 0 && !w->quoted) return NULL;
+    return b.data;
+}
+
+// break [n] and continue [n] inside a loop jump to the end of the nth enclosing one, or to
+// its next pass. A count that is not a number as typed is left to the builtin to report.
+void compile_loop_exit(Code* code, Node* node) {
+    char** words = node->words;
+    long count = 1;
+    if (node->n > 2 || code->loop == NULL) {
+        emit(code, OP_EXEC, node);
+        return;
+    }
+    if (node->n == 2) {
+        char* end;
+        count = strtol(words[1], &end, 10);
+        if (!(node->flags & NODE_PLAIN) || *end != '\0' || end == words[1] || count < 1) {
+            emit(code, OP_EXEC, node);
+            return;
+        }
+    }
+    // A count past the outermost loop means the outermost
+    LoopCtx* loop = code->loop;
+    while (--count > 0 && loop->outer != NULL) loop = loop->outer;
+    int k = emit(code, OP_STATUS, node);
+    code->instrs[k].arg = 0;
+    k = emit(code, OP_JUMP, NULL);
+    int* chain = strcmp(words[0], "break") == 0 ? &loop->breaks : &loop->continues;
+    code->instrs[k].arg = *chain;
+    *chain = k;
+}
+
+// Run compiled code. status is the register the jumps test; every instruction that runs a
+// command also sets $?. A loop releases what its pass allocated in the command arena when
+// it goes round, so a long loop runs in the memory of one pass.
+int vm_run(Code* code, Shell* sh) {
+    LoopState* loops = arena_alloc(&cmd_arena, sizeof(LoopState) * (code->loops > 0 ? code->loops : 1));
+    int status = 0;
+    int pc = 0;
+    for (;;) {
+        Instr* in = &code->instrs[pc++];
+        LoopState* loop = &loops[in->slot];
+        Node* node = in->node;
+        switch (in->op) {
+        case OP_EXEC:
+            status = last_status = exec_node(node, sh, 0);
+            break;
+        case OP_BACKGROUND:
+            status = last_status = execute(node, sh, 0, 1);
+            break;
+        case OP_BUILTIN:
+            status = last_status = run_builtin(in->builtin, node->words, sh, STDOUT_FILENO);
+            break;
+        case OP_BUILTIN_WORDS: {
+            char** argv = arena_alloc(&cmd_arena, sizeof(char*) * (node->n + 1));
+            int n = 0;
+            for (int i = 0; i < node->n; i++) {
+                if ((argv[n] = word_expand(&in->words[i], sh->vars)) != NULL) n++;
+            }
+            argv[n] = NULL;
+            status = last_status = run_builtin(in->builtin, argv, sh, STDOUT_FILENO);
+            break;
+        }
+        case OP_BUILTIN_EXPAND: {
+            expansion_failed = 0;
+            char** argv = expand_words(node->words, node->n, &cmd_arena, sh->vars);
+            status = last_status = expansion_failed ? 1 : run_builtin(in->builtin, argv, sh, STDOUT_FILENO);
+            break;
+        }
+        case OP_SET:
+            var_ref_set(in->var, in->value, sh->vars);
+            status = last_status = 0;
+            break;
+        case OP_COPY: {
+            Var* from = var_ref_find(in->from, sh->vars);
+            const char* value = from != NULL ? from->value : getenv(in->from->name);
+            var_ref_set(in->var, value != NULL ? value : "", sh->vars);
+            status = last_status = 0;
+            break;
+        }
+        case OP_CONCAT: {
+            char* value = word_expand(in->words, sh->vars);
+            var_ref_set(in->var, value != NULL ? value : "", sh->vars);
+            status = last_status = 0;
+            break;
+        }
+        case OP_ARITH: {
+            long num;
+            expansion_failed = 0;
+            status = last_status = arith_eval(in->value, &num, sh->vars) || expansion_failed;
+            if (status == 0) var_ref_set_num(in->var, num, sh->vars);
+            break;
+        }
+        case OP_ASSIGN:
+            expansion_failed = 0;
+            subst_status = 0;
+            assign_vars(node->words, sh);
+            status = last_status = expansion_failed ? 1 : subst_status;
+            break;
+        case OP_STATUS:
+            status = last_status = in->arg;
+            break;
+        case OP_NOT:
+            status = last_status = !status;
+            break;
+        case OP_JUMP:
+            pc = in->arg;
+            break;
+        case OP_JUMP_TRUE:
+            if (status == 0) pc = in->arg;
+            break;
+        case OP_JUMP_FALSE:
+            if (status != 0) pc = in->arg;
+            break;
+        case OP_LOOP_INIT:
+            loop->status = 0;
+            loop->mark = arena_mark(&cmd_arena);
+            break;
+        case OP_FOR_INIT:
+            expansion_failed = 0;
+            loop->items = node->flags & NODE_PLAIN ? node->words + 1
+                                                   : expand_words(node->words + 1, node->n - 1, &cmd_arena, sh->vars);
+            // Words that fail to expand make a loop of no passes that fails
+            if (expansion_failed) loop->items = node->words + node->n;
+            loop->next = 0;
+            loop->status = expansion_failed;
+            loop->mark = arena_mark(&cmd_arena);
+            break;
+        case OP_FOR_NEXT:
+            if (loop->items[loop->next] == NULL) {
+                pc = in->arg;
+            } else {
+                var_ref_set(in->var, loop->items[loop->next++], sh->vars);
+            }
+            break;
+        case OP_LOOP:
+            loop->status = status;
+            arena_rewind(&cmd_arena, loop->mark);
+            pc = in->arg;
+            break;
+        case OP_LOOP_STATUS:
+            status = last_status = loop->status;
+            break;
+        case OP_END:
+            return status;
+        }
+    }
+}
+
+// batch [-j jobs] [-n max] command [fixed...] [-- items...]
+// Run command over the items in as few invocations as ARG_MAX allows, like xargs without
+// the pipe: each invocation gets the fixed words followed by as many items as fit in what
+// execve accepts after the environment. Without --, every word after the command is an
+// item. -n caps the items per invocation; -j runs up to that many invocations at once
+// (0 means one per CPU). Returns the first non-zero status of any invocation.
+int run_batch(char* argv[], int in, int out, Shell* sh) {
+    long jobs = 1, max_items = LONG_MAX;
+    int i = 1, bad = 0;
+    while (argv[i] != NULL && (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "-n") == 0)) {
+        long n;
+        if (argv[i + 1] == NULL || !test_number(argv[i + 1], &n, &(int){ 0 }) || n < 0 ||
+            (argv[i][1] == 'n' && n == 0)) {
+            bad = 1;
+            break;
+        }
+        if (argv[i][1] == 'j') {
+            jobs = n > 0 ? n : sysconf(_SC_NPROCESSORS_ONLN);
+        } else {
+            max_items = n;
+        }
+        i += 2;
+    }
+    if (bad || argv[i] == NULL) {
+        fprintf(stderr, "batch: usage: batch [-j jobs] [-n max] command [fixed...] [-- item...]\n");
+        return 2;
+    }
+    char** fixed = argv + i;
+    int nfixed = 1;
+    while (fixed[nfixed] != NULL && strcmp(fixed[nfixed], "--") != 0) nfixed++;
+    char** items = fixed[nfixed] != NULL ? fixed + nfixed + 1 : fixed + 1;
+    if (fixed[nfixed] == NULL) nfixed = 1;
+    int nitems = 0;
+    while (items[nitems] != NULL) nitems++;
+
+    // Builtins are not exec'd, so there is no limit to respect: one call with everything
+    const Builtin* b = find_builtin(fixed[0]);
+    if (b != NULL) {
+        char** all = arena_alloc(&cmd_arena, sizeof(char*) * (nfixed + nitems + 1));
+        memcpy(all, fixed, sizeof(char*) * nfixed);
+        memcpy(all + nfixed, items, sizeof(char*) * (nitems + 1));
+        return run_builtin(b, all, sh, out != -1 ? out : STDOUT_FILENO);
+    }
+
+    // Bytes each invocation may spend on items: execve counts every string with its NUL
+    // and one pointer, for the environment as well as argv
+    long budget = sysconf(_SC_ARG_MAX);
+    if (budget <= 0) budget = _POSIX_ARG_MAX;
+    budget -= ARG_HEADROOM + sizeof(char*);
+    for (char** e = exec_env ? exec_env : environ; *e != NULL; e++) {
+        budget -= strlen(*e) + 1 + sizeof(char*);
+    }
+    for (int k = 0; k < nfixed; k++) {
+        budget -= strlen(fixed[k]) + 1 + sizeof(char*);
+    }
+    if (budget <= 0) {
+        fprintf(stderr, "batch: %s: environment and fixed arguments already exceed ARG_MAX\n", fixed[0]);
+        return 126;
+    }
+
+    fflush(stdout);
+    Job** running = arena_alloc(&cmd_arena, sizeof(Job*) * jobs);
+    int nrunning = 0, status = 0;
+    int pos = 0;
+    do {
+        // Take items while they fit; one that could never fit is reported and skipped
+        long used = 0;
+        int n = 0;
+        while (pos + n < nitems && n < max_items) {
+            size_t len = strlen(items[pos + n]);
+            long cost = len + 1 + sizeof(char*);
+            if (len + 1 > ARG_STRLEN_MAX || cost > budget) {
+                if (n > 0) break;
+                fprintf(stderr, "batch: argument of %zu bytes is too long to pass\n", len);
+                if (status == 0) status = 126;
+                pos++;
+                continue;
+            }
+            if (used + cost > budget) break;
+            used += cost;
+            n++;
+        }
+        if (n == 0 && nitems > 0) continue;  // Only oversized items were left
+
+        char** chunk = arena_alloc(&cmd_arena, sizeof(char*) * (nfixed + n + 1));
+        memcpy(chunk, fixed, sizeof(char*) * nfixed);
+        memcpy(chunk + nfixed, items + pos, sizeof(char*) * n);
+        chunk[nfixed + n] = NULL;
+        pos += n;
+
+        while (nrunning == jobs) {
+            batch_reap(running, &nrunning, &status);
+        }
+        pid_t pid = spawn_mode == SPAWN_FORK ? fork_stage(chunk, in, out) : spawn_stage(chunk, in, out);
+        if (pid > 0) {
+            running[nrunning++] = job_create(&pid, 1, NULL, 0);
+        } else if (status == 0) {
+            status = 127;
+        }
+    } while (pos < nitems);
+
+    while (nrunning > 0) {
+        batch_reap(running, &nrunning, &status);
+    }
+    return status;
+}
+
+// Background form: run the whole batch in a forked subshell
+pid_t batch_stage(char* argv[], int in, int out, Shell* sh) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        events_reset();
+        _exit(run_batch(argv, in, out, sh));
+    } else if (pid < 0) {
+        perror("Fork failed");
+    }
+    return pid;
+}
+
+// Pipeline stage form: the stage child already has its stdin and stdout in place, and a
+// lone batch never gets here because execute() runs it directly
+int builtin_batch(char* argv[], Shell* sh, Out* out) {
+    out_flush(out);
+    return run_batch(argv, -1, out->fd == STDOUT_FILENO ? -1 : out->fd, sh);
+}
+
+// Wait until one of the running invocations finishes, keeping the first failure in *status
+void batch_reap(Job* running[], int* nrunning, int* status) {
+    for (;;) {
+        for (int k = 0; k < *nrunning; k++) {
+            if (running[k]->running == 0) {
+                if (*status == 0) *status = running[k]->procs[0].status;
+                job_free(running[k]);
+                running[k] = running[--*nrunning];
+                return;
+            }
+        }
+        events_poll(-1);
+    }
+}
+
+// Set up the event loop. SIGCHLD is blocked for good so it only arrives through the
+// signalfd; an inherited SIG_IGN would have the kernel reap children behind our back.
+void events_init() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (event_fd < 0 || sigchld_fd < 0) {
+        perror("Event loop setup failed");
+        exit(1);
+    }
+}
+
+// A forked subshell has none of the parent's children: leave the shared epoll set alone,
+// a fresh loop is made if the subshell starts children itself. The job list stays as a
+// snapshot so jobs still lists the parent's jobs in a pipeline.
+void events_reset() {
+    if (event_fd >= 0) close(event_fd);
+    if (sigchld_fd >= 0) close(sigchld_fd);
+    event_fd = sigchld_fd = -1;
+    sigchld_watched = 0;
+    unwatched = 0;
+    // Queued jobs are the parent's to start
+    queue_first = queue_last = NULL;
+    queued_jobs = 0;
+    bg_running = 0;
+    // Listed, but not ours to wait for or signal by number
+    if (job_ids.count > 0) {
+        memset(job_ids.slots, 0, sizeof(IndexSlot) * job_ids.size);
+        job_ids.count = 0;
+    }
+}
+
+// Handle what the event loop has ready, waiting up to timeout ms (-1 blocks).
+// A ready pidfd reaps exactly its own child, so each completion is O(1).
+int events_poll(int timeout) {
+    struct epoll_event ready[EVENT_BATCH];
+    int n = epoll_wait(event_fd, ready, EVENT_BATCH, timeout);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        perror("epoll_wait");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        Proc* p = ready[i].data.ptr;
+        int st;
+        if (p != NULL) {
+            if (!p->done && waitpid(p->pid, &st, WNOHANG) == p->pid) proc_reap(p, st);
+            continue;
+        }
+        struct signalfd_siginfo info[16];
+        while (read(sigchld_fd, info, sizeof(info)) > 0);  // Drain; signals coalesce anyway
+        pid_t pid;
+        while (unwatched > 0 && (pid = waitpid(-1, &st, WNOHANG)) > 0) {
+            Proc* q = index_get(&job_pids, pid);
+            if (q != NULL) proc_reap(q, st);
+        }
+    }
+    // Finished background jobs may have freed maxjobs slots
+    if (queue_first != NULL) jobs_start_queued();
+    return n;
+}
+
+// Record a child's exit and stop watching it. The job's status is settled when its last
+// stage goes; a finished background job is queued for jobs_collect().
+void proc_reap(Proc* p, int st) {
+    if (p->pidfd >= 0) {
+        // Forked subshells may hold the pidfd too, so closing alone would not unregister it
+        epoll_ctl(event_fd, EPOLL_CTL_DEL, p->pidfd, NULL);
+        close(p->pidfd);
+        p->pidfd = -1;
+    } else if (--unwatched == 0) {
+        sigchld_watch(0);
+    }
+    index_remove(&job_pids, p->pid);
+    p->status = WIFSIGNALED(st) ? 128 + WTERMSIG(st) : WEXITSTATUS(st);
+    p->done = 1;
+    Job* job = p->job;
+    if (--job->running == 0) {
+        job->status = job->procs[job->nprocs - 1].status;
+        clock_gettime(CLOCK_MONOTONIC, &job->end);
+        if (job->id != 0) {
+            bg_running--;
+            job->done_next = jobs_done;
+            jobs_done = job;
+        }
+    }
+}
+
+// Track the children of one pipeline as a job; pids[i] <= 0 is a stage that never started.
+// command is kept for jobs and may be NULL. A background job gets the next job number.
+Job* job_create(pid_t pids[], int n, const char* command, int background) {
+    Job* job = job_alloc(n, command, background);
+    job_track(job, pids);
+    return job;
+}
+
+// A job of n stages, none started yet, on the live job list
+Job* job_alloc(int n, const char* command, int background) {
+    if (event_fd < 0) events_init();
+    size_t command_len = command != NULL ? strlen(command) : 0;
+    Job* job = xmalloc(sizeof(Job) + sizeof(Proc) * n + command_len + 1);
+    job->procs = (Proc*)(job + 1);
+    job->command = (char*)(job->procs + n);
+    memcpy(job->command, command != NULL ? command : "", command_len + 1);
+    job->id = background ? job_counter++ : 0;
+    job->nprocs = n;
+    job->running = 0;
+    job->status = 127;
+    job->reported = 0;
+    job->done_next = NULL;
+    job->queued = 0;
+    job->stages = NULL;
+    job->store = (Arena){ NULL, NULL, 0, 0, 0 };
+    job->sh = NULL;
+    job->cwd_fd = -1;
+    job->env = NULL;
+    job->path = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->end = job->start;
+    for (int i = 0; i < n; i++) {
+        job->procs[i].pid = 0;
+        job->procs[i].pidfd = -1;
+        job->procs[i].status = 127;
+        job->procs[i].done = 1;
+        job->procs[i].job = job;
+    }
+    if (background) {
+        index_put(&job_ids, job->id, job);
+    }
+    job->next = NULL;
+    job->prev = jobs_last;
+    if (jobs_last != NULL) {
+        jobs_last->next = job;
+    } else {
+        jobs_first = job;
+    }
+    jobs_last = job;
+    return job;
+}
+
+// Register the started stages of a job with the event loop
+void job_track(Job* job, pid_t pids[]) {
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    for (int i = 0; i < job->nprocs; i++) {
+        Proc* p = &job->procs[i];
+        p->pid = pids[i];
+        if (pids[i] <= 0) continue;
+        p->done = 0;
+        job->running++;
+        index_put(&job_pids, pids[i], p);
+        // A child that already exited is a zombie until we reap it, so its pid is still ours
+        if (job->id == 0) {
+            p->pidfd = syscall(SYS_pidfd_open, pids[i], 0);
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = p };
+            if (p->pidfd >= 0 && epoll_ctl(event_fd, EPOLL_CTL_ADD, p->pidfd, &ev) == 0) continue;
+            if (p->pidfd >= 0) close(p->pidfd);
+            p->pidfd = -1;
+        }
+        if (unwatched++ == 0) sigchld_watch(1);
+    }
+    if (job->id != 0) {
+        if (job->running > 0) {
+            bg_running++;
+        } else {
+            job->end = job->start;
+            job->done_next = jobs_done;
+            jobs_done = job;
+        }
+    }
+}
+
+// Hold a background job until a maxjobs slot frees up. Its stages are copied out of the
+// command arena, which is reset after every line: argv as expanded now, compound stages
+// as command trees that expand when they start. Redirections stay open meanwhile, and the
+// working directory, environment and PATH are kept so the job starts where it was typed.
+Job* job_queue(Stage stages[], int n, long pipe_bytes, const char* command, Shell* sh) {
+    size_t words = 0, bytes = 0, tree_bytes = 0;
+    for (int i = 0; i < n; i++) {
+        if (stages[i].body != NULL) {
+            tree_bytes += node_size(stages[i].body);
+            continue;
+        }
+        for (char** w = stages[i].argv; *w != NULL; w++) {
+            words++;
+            bytes += strlen(*w) + 1;
+        }
+        words++;  // NULL
+    }
+    Job* job = job_alloc(n, command, 1);
+    job->stages = xmalloc(sizeof(Stage) * n + sizeof(char*) * words + bytes);
+    if (tree_bytes > 0) arena_init(&job->store, tree_bytes);
+    char** argv = (char**)(job->stages + n);
+    char* str = (char*)(argv + words);
+    for (int i = 0; i < n; i++) {
+        job->stages[i] = stages[i];
+        if (stages[i].body != NULL) {
+            job->stages[i].argv = NULL;
+            job->stages[i].body = node_copy(stages[i].body, &job->store);
+            continue;
+        }
+        job->stages[i].argv = argv;
+        for (char** w = stages[i].argv; *w != NULL; w++) {
+            size_t len = strlen(*w) + 1;
+            memcpy(str, *w, len);
+            *argv++ = str;
+            str += len;
+        }
+        *argv++ = NULL;
+    }
+    // The queue owns the redirections now
+    for (int i = 0; i < n; i++) {
+        stages[i].in = stages[i].out = -1;
+    }
+    job->queued = 1;
+    job->pipe_bytes = pipe_bytes;
+    job->sh = sh;
+    job->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    // Environment and PATH copied in one block, laid out like exec_env
+    char** env = exec_env ? exec_env : environ;
+    const char* path = search_path();
+    size_t count = 0, env_bytes = path != NULL ? strlen(path) + 1 : 0;
+    for (char** e = env; *e != NULL; e++) {
+        count++;
+        env_bytes += strlen(*e) + 1;
+    }
+    job->env = xmalloc((count + 1) * sizeof(char*) + env_bytes);
+    char* dst = (char*)(job->env + count + 1);
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(env[i]) + 1;
+        job->env[i] = memcpy(dst, env[i], len);
+        dst += len;
+    }
+    job->env[count] = NULL;
+    job->path = path != NULL ? strcpy(dst, path) : NULL;
+    job->queue_next = NULL;
+    job->queue_prev = queue_last;
+    if (queue_last != NULL) {
+        queue_last->queue_next = job;
+    } else {
+        queue_first = job;
+    }
+    queue_last = job;
+    queued_jobs++;
+    return job;
+}
+
+// Take a job off the queue and give back what it was holding
+void job_unqueue(Job* job) {
+    if (job->queue_prev != NULL) {
+        job->queue_prev->queue_next = job->queue_next;
+    } else {
+        queue_first = job->queue_next;
+    }
+    if (job->queue_next != NULL) {
+        job->queue_next->queue_prev = job->queue_prev;
+    } else {
+        queue_last = job->queue_prev;
+    }
+    queued_jobs--;
+    job->queued = 0;
+    close_stages(job->stages, job->nprocs);
+    free(job->stages);
+    job->stages = NULL;
+    arena_free(&job->store);
+    if (job->cwd_fd >= 0) close(job->cwd_fd);
+    job->cwd_fd = -1;
+    free(job->env);
+    job->env = NULL;
+    job->path = NULL;
+}
+
+// Start a queued job now, the way execute() would have when it was typed. The shell steps
+// into the job's directory and environment while it starts the stages, then steps back.
+void job_launch(Job* job) {
+    Shell* sh = job->sh;
+    pid_t* pids = arena_alloc(&cmd_arena, sizeof(pid_t) * job->nprocs);
+    int here = -1;
+    if (job->cwd_fd >= 0) {
+        here = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (here >= 0 && fchdir(job->cwd_fd) < 0) {
+            close(here);
+            here = -1;
+        }
+    }
+    char** env = exec_env;
+    exec_env = job->env;
+    job_path = job->path;
+
+    char** argv = job->stages[0].argv;
+    if (job->nprocs == 1 && argv != NULL && argv[0] != NULL && strcmp(argv[0], "batch") == 0) {
+        pids[0] = batch_stage(argv, job->stages[0].in, job->stages[0].out, sh);
+    } else {
+        launch_pipeline(job->stages, job->nprocs, pids, sh, job->pipe_bytes);
+    }
+
+    exec_env = env;
+    job_path = NULL;
+    if (here >= 0) {
+        if (fchdir(here) < 0) perror("fchdir");
+        close(here);
+    }
+    job_unqueue(job);
+    job_track(job, pids);
+}
+
+// Start queued jobs, oldest first, while there are maxjobs slots free
+void jobs_start_queued() {
+    while (queue_first != NULL && (max_jobs == 0 || bg_running < max_jobs)) {
+        job_launch(queue_first);
+    }
+}
+
+// Add or remove the signalfd from the event loop. NULL marks it; a SIGCHLD that came
+// while it was out stays pending and makes it ready at once.
+void sigchld_watch(int on) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (on == sigchld_watched) return;
+    if (epoll_ctl(event_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, sigchld_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    sigchld_watched = on;
+}
+
+// Drop a finished job
+void job_free(Job* job) {
+    if (job->prev != NULL) {
+        job->prev->next = job->next;
+    } else {
+        jobs_first = job->next;
+    }
+    if (job->next != NULL) {
+        job->next->prev = job->prev;
+    } else {
+        jobs_last = job->prev;
+    }
+    if (job->id != 0) index_remove(&job_ids, job->id);
+    free(job->stages);
+    free(job);
+}
+
+// Block until every stage of job has exited; the last stage gives the status
+int job_wait(Job* job) {
+    while (job->running > 0) {
+        events_poll(-1);
+    }
+    return job->status;
+}
+
+// Reap whatever has finished without blocking, then report and drop finished background
+// jobs. Only the finished ones are visited, however many are still running.
+void jobs_collect() {
+    if (jobs_first == NULL) return;  // Nothing running, nothing to poll
+    while (events_poll(0) == EVENT_BATCH);
+    // The queue is newest first; report in the order the jobs finished
+    Job* queue = NULL;
+    while (jobs_done != NULL) {
+        Job* job = jobs_done;
+        jobs_done = job->done_next;
+        job->done_next = queue;
+        queue = job;
+    }
+    while (queue != NULL) {
+        Job* job = queue;
+        queue = job->done_next;
+        if (interactive && !job->reported) {
+            if (job->status == 0) {
+                printf("[%d] Done\t%s\n", job->id, job->command);
+            } else {
+                printf("[%d] Exit %d\t%s\n", job->id, job->status, job->command);
+            }
+        }
+        job_free(job);
+    }
+}
+
+// jobs [-l | -p]: list background jobs oldest first. -l adds every stage's pid and the
+// time each job has been running; -p prints only the pids.
+int builtin_jobs(char* argv[], Shell* sh, Out* out) {
+    int mode = 0;
+    if (argv[1] != NULL) {
+        if (strcmp(argv[1], "-l") == 0 || strcmp(argv[1], "-p") == 0) {
+            mode = argv[1][1];
+        } else {
+            fprintf(stderr, "jobs: usage: jobs [-l | -p]\n");
+            return 2;
+        }
+    }
+    // Settle anything that already finished; a subshell only has the snapshot it inherited
+    if (event_fd >= 0) {
+        while (events_poll(0) == EVENT_BATCH);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (Job* job = jobs_first; job != NULL; job = job->next) {
+        if (job->id == 0) continue;
+        if (mode == 'p') {
+            for (int i = 0; i < job->nprocs; i++) {
+                if (job->procs[i].pid > 0) out_printf(out, "%d\n", job->procs[i].pid);
+            }
+            continue;
+        }
+        out_printf(out, "[%d] ", job->id);
+        if (mode == 'l') {
+            for (int i = 0; i < job->nprocs; i++) {
+                out_printf(out, "%d ", job->procs[i].pid);
+            }
+        }
+        if (job->queued) {
+            out_puts(out, "Queued");
+        } else if (job->running > 0) {
+            out_puts(out, "Running");
+        } else if (job->status == 0) {
+            out_puts(out, "Done");
+        } else {
+            out_printf(out, "Exit %d", job->status);
+        }
+        if (mode == 'l') {
+            const struct timespec* until = job->running > 0 || job->queued ? &now : &job->end;
+            out_printf(out, " %.2fs", (until->tv_sec - job->start.tv_sec) + (until->tv_nsec - job->start.tv_nsec) / 1e9);
+        }
+        out_printf(out, "\t%s\n", job->command);
+        // Finished jobs shown here are not announced again
+        if (job->running == 0 && !job->queued) job->reported = 1;
+    }
+    return 0;
+}
+
+// kill [-signal] job...: signal every running stage of background jobs, given by number
+// with or without a leading %. SIGKILL unless a signal is named.
+int builtin_kill(char* argv[], Shell* sh, Out* out) {
+    int sig = SIGKILL;
+    int i = 1, status = 0;
+    if (argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0') {
+        sig = signal_number(argv[i] + 1);
+        if (sig < 0) {
+            fprintf(stderr, "kill: unknown signal: %s\n", argv[i] + 1);
+            return 2;
+        }
+        i++;
+    }
+    if (argv[i] == NULL) {
+        fprintf(stderr, "kill: expected job ID\n");
+        return 2;
+    }
+    for (; argv[i] != NULL; i++) {
+        Job* job = job_lookup(argv[i]);
+        if (job == NULL) {
+            fprintf(stderr, "kill: no such job ID: %s\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        // A queued job never starts; it finishes as if the signal had killed it
+        if (job->queued) {
+            job_unqueue(job);
+            job->status = 128 + sig;
+            job->done_next = jobs_done;
+            jobs_done = job;
+            continue;
+        }
+        for (int k = 0; k < job->nprocs; k++) {
+            if (!job->procs[k].done && kill(job->procs[k].pid, sig) != 0) {
+                perror("kill failed");
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
+
+// wait [job...]: block until the given background jobs have finished, or without
+// arguments until every one has, queued jobs included. Returns the last job's status.
+int builtin_wait(char* argv[], Shell* sh, Out* out) {
+    if (argv[1] == NULL) {
+        while (bg_running > 0 || queue_first != NULL) {
+            events_poll(-1);
+        }
+        // Waited for, so not announced
+        for (Job* job = jobs_done; job != NULL; job = job->done_next) {
+            job->reported = 1;
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        Job* job = job_lookup(argv[i]);
+        if (job == NULL) {
+            fprintf(stderr, "wait: no such job ID: %s\n", argv[i]);
+            status = 127;
+            continue;
+        }
+        while (job->queued || job->running > 0) {
+            events_poll(-1);
+        }
+        job->reported = 1;
+        status = job->status;
+    }
+    return status;
+}
+
+// Background job named by its number, with or without a leading %
+Job* job_lookup(const char* spec) {
+    long id;
+    int error = 0;
+    if (spec[0] == '%') spec++;
+    if (!test_number(spec, &id, &error) || id <= 0 || id > INT_MAX) return NULL;
+    return index_get(&job_ids, (int)id);
+}
+
+// Signal number for a name like TERM or SIGTERM, or a number; -1 if unknown
+int signal_number(const char* name) {
+    static const struct { const char* name; int sig; } names[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+        { "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+    };
+    long n;
+    int error = 0;
+    if (test_number(name, &n, &error)) {
+        return n >= 0 && n < NSIG ? (int)n : -1;
+    }
+    if (strncmp(name, "SIG", 3) == 0) name += 3;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(names[i].name, name) == 0) return names[i].sig;
+    }
+    return -1;
+}
+
+unsigned long index_hash(int key) {
+    uint32_t h = (uint32_t)key * 2654435761u;  // Knuth's multiplicative hash, then fold the high bits down
+    return h ^ (h >> 16);
+}
+
+void* index_get(Index* index, int key) {
+    if (index->size == 0) return NULL;
+    unsigned long mask = index->size - 1;
+    for (unsigned long i = index_hash(key) & mask; index->slots[i].key != 0; i = (i + 1) & mask) {
+        if (index->slots[i].key == key) return index->slots[i].value;
+    }
+    return NULL;
+}
+
+// Insert or replace key
+void index_put(Index* index, int key, void* value) {
+    // Grow at 3/4 load so probe sequences stay short
+    if ((index->count + 1) * 4 > index->size * 3) {
+        IndexSlot* old = index->slots;
+        int old_size = index->size;
+        index->size = old_size ? old_size * 2 : HASH_INIT_SIZE;
+        index->slots = xcalloc(index->size, sizeof(IndexSlot));
+        index->count = 0;
+        for (int j = 0; j < old_size; j++) {
+            if (old[j].key != 0) index_put(index, old[j].key, old[j].value);
+        }
+        free(old);
+    }
+    unsigned long mask = index->size - 1;
+    unsigned long i = index_hash(key) & mask;
+    while (index->slots[i].key != 0 && index->slots[i].key != key) i = (i + 1) & mask;
+    if (index->slots[i].key == 0) index->count++;
+    index->slots[i].key = key;
+    index->slots[i].value = value;
+}
+
+// Remove key, shifting later entries of its probe run back into place
+void index_remove(Index* index, int key) {
+    if (index->size == 0) return;
+    unsigned long mask = index->size - 1;
+    unsigned long i = index_hash(key) & mask;
+    while (index->slots[i].key != 0 && index->slots[i].key != key) i = (i + 1) & mask;
+    if (index->slots[i].key == 0) return;
+    index->slots[i].key = 0;
+    index->count--;
+
+    unsigned long j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (index->slots[j].key == 0) break;
+        unsigned long home = index_hash(index->slots[j].key) & mask;
+        // Move the entry back if its home slot is not between the hole and j
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            index->slots[i] = index->slots[j];
+            index->slots[j].key = 0;
+            i = j;
+        }
+    }
+}
+
+// Plan-time rewrite of cat stages that only move bytes: `cat FILE | cmd` becomes
+// `cmd < FILE` when FILE is a regular file, and an argument-less cat is dropped wherever its output is a pipe or
+// a file (`a | cat | b`, `cmd | cat > FILE`). A final cat writing to the terminal is
+// kept, since dropping it would hand the terminal to the previous stage. Stages with
+// redirections of their own in the way are left alone.
+// Returns the new number of stages.
+int elide_cat(Stage stages[], int num_cmds) {
+    int n = 0;
+    for (int i = 0; i < num_cmds; i++) {
+        char** argv = stages[i].argv;
+        int is_cat = num_cmds > 1 && argv != NULL && argv[0] != NULL && strcmp(argv[0], "cat") == 0 &&
+                     stages[i].in == -1;
+        if (is_cat && i == 0 && argv[1] != NULL && argv[1][0] != '-' && argv[2] == NULL &&
+            stages[i].out == -1 && stages[1].in == -1) {
+            // Opened without blocking: a FIFO's writer may be a stage not started yet, and
+            // devices or directories are left to cat
+            struct stat st;
+            int fd = open(argv[1], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd >= 0 && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+                            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0)) {
+                close(fd);
+                fd = -1;
+            }
+            if (fd >= 0) {  // Otherwise leave it to cat to report
+                stages[1].in = fd;
+                cat_elided++;
+                continue;
+            }
+        } else if (is_cat && argv[1] == NULL && n + (num_cmds - 1 - i) > 0) {
+            if (i < num_cmds - 1 && stages[i].out == -1) {
+                cat_elided++;
+                continue;
+            }
+            // Last, writing a file: the stage before writes it instead
+            if (i == num_cmds - 1 && stages[i].out != -1 && stages[n - 1].out == -1) {
+                stages[n - 1].out = stages[i].out;
+                cat_elided++;
+                continue;
+            }
+        }
+        stages[n++] = stages[i];
+    }
+    return n;
+}
+
+// Create the pipes for a pipeline and start every stage, returning how many were launched.
+// pids[i] is the pid of stage i, or -1 if it could not be started. pipe_bytes > 0 sets the
+// capacity of every pipe. Each pipe is created just before the stage that writes it and the
+// shell's ends are closed as soon as both neighbours are running, so the shell holds at most
+// two pipes however long the pipeline. A stage's own redirections take the place of its
+// pipe ends. All of them are close-on-exec: exec'd stages keep only what was dup2'd onto
+// stdin/stdout, and forked builtin and compound stages close the rest themselves.
+int launch_pipeline(Stage stages[], int num_cmds, pid_t pids[], Shell* sh, long pipe_bytes) {
+    int prev_read = -1;  // What the next stage reads from
+    int launched = 0;
+    int warned = 0;
+
+    // Anything the shell printed must come out before the children's output
+    fflush(stdout);
+
+    for (int i = 0; i < num_cmds; i++) {
+        Stage* s = &stages[i];
+        int pipefd[2] = { -1, -1 };
+        if (i < num_cmds - 1) {
+            if (pipe2(pipefd, O_CLOEXEC) == -1) {
+                perror("Pipe failed");
+                exit(1);
+            }
+            // Past /proc/sys/fs/pipe-max-size this needs CAP_SYS_RESOURCE; say so once
+            if (pipe_bytes > 0 && fcntl(pipefd[1], F_SETPIPE_SZ, (int)pipe_bytes) < 0 && !warned) {
+                fprintf(stderr, "pipesize: cannot set pipe size to %ld: %s\n", pipe_bytes, strerror(errno));
+                warned = 1;
+            }
+        }
+        int in_fd = s->in != -1 ? s->in : prev_read;
+        int out_fd = s->out != -1 ? s->out : pipefd[1];
+
+        const Builtin* b = s->argv != NULL && s->argv[0] != NULL ? find_builtin(s->argv[0]) : NULL;
+        pid_t pid;
+        if (s->body != NULL || b != NULL) {
+            // Everything the shell has open for this stage
+            int close_fds[5], nclose = 0;
+            if (s->in != -1) close_fds[nclose++] = s->in;
+            if (s->out != -1) close_fds[nclose++] = s->out;
+            if (prev_read != -1) close_fds[nclose++] = prev_read;
+            if (pipefd[0] != -1) {
+                close_fds[nclose++] = pipefd[0];
+                close_fds[nclose++] = pipefd[1];
+            }
+            if (s->body != NULL) {
+                pid = subshell_stage(s->body, sh, in_fd, out_fd, close_fds, nclose);
+            } else if (num_cmds > 1 && !(b->flags & BUILTIN_PIPELINE)) {
+                fprintf(stderr, "%s: cannot be used in a pipeline\n", s->argv[0]);
+                pid = -1;
+            } else {
+                pid = builtin_stage(b, s->argv, sh, in_fd, out_fd, close_fds, nclose);
+            }
+        } else if (spawn_mode == SPAWN_FORK) {
+            pid = fork_stage(s->argv, in_fd, out_fd);
+        } else {
+            pid = spawn_stage(s->argv, in_fd, out_fd);
+        }
+        pids[i] = pid;
+        if (pid > 0) {
+            launched++;
+        }
+
+        // The redirections belong to the caller; pipe ends are done with once handed over
+        if (prev_read != -1) close(prev_read);
+        if (pipefd[1] != -1) close(pipefd[1]);
+        prev_read = pipefd[0];
+    }
+    return launched;
+}
+
+// Start one stage with posix_spawn; glibc runs it via clone(CLONE_VM|CLONE_VFORK),
+// so the child shares our address space until execve instead of copying page tables.
+// The dup2 work a forked child would do is expressed as file actions; everything else
+// the shell has open is close-on-exec.
+pid_t spawn_stage(char* argv[], int in_fd, int out_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t pid;
+    int err = ENOENT;
+
+    if (argv[0] == NULL) {
+        return -1;
+    }
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    // The shell blocks SIGCHLD around launches; children start with the original mask
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &child_sigmask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    // A cached path that has gone away is dropped and resolved again once
+    for (int attempt = 0; attempt < 2; attempt++) {
+        char* path = hash_lookup(argv[0]);
+        if (path == NULL) {
+            err = ENOENT;
+            break;
+        }
+        err = posix_spawn(&pid, path, &actions, &attr, argv, exec_env ? exec_env : environ);
+        if (err != ENOENT || strchr(argv[0], '/') != NULL) {
+            break;
+        }
+        hash_remove(argv[0]);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err == E2BIG) {
+        fprintf(stderr, "%s: %s (batch splits long argument lists)\n", argv[0], strerror(err));
+        return -1;
+    } else if (err != 0) {
+        fprintf(stderr, "%s: Command Not Found: %s\n", argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// Start one stage with a full fork; kept for stages that need to run code in the child
+pid_t fork_stage(char* argv[], int in_fd, int out_fd) {
+    // Resolve in the parent so the result stays in the shell's cache
+    char* path = argv[0] != NULL ? hash_lookup(argv[0]) : NULL;
+    pid_t pid = fork();
+    if (pid == 0) {  // Child process
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        if (in_fd != -1) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != -1) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        if (argv[0] == NULL) {
+            exit(0);
+        }
+        if (path != NULL) {
+            execve(path, argv, exec_env ? exec_env : environ);
+        } else {
+            errno = ENOENT;
+        }
+        perror("Command Not Found");
+        exit(127);
+    } else if (pid < 0) {
+        perror("Fork failed");
+    }
+    return pid;
+}
+
+// FNV-1a string hash used by the shell's hash tables
+unsigned long hash_str(const char* str) {
+    unsigned long h = 14695981039346656037UL;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// Same hash over the first len bytes, for names that are not NUL-terminated
+unsigned long hash_strn(const char* str, size_t len) {
+    unsigned long h = 14695981039346656037UL;
+    while (len-- > 0) {
+        h ^= (unsigned char)*str++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// PATH used for command lookup. It is read from the variable table on every call,
+// never kept: storing PATH may move or free the old value.
+const char* search_path(void) {
+    if (job_path != NULL) return job_path;
+    const char* path = current_shell != NULL ? get_var("PATH", current_shell->vars) : NULL;
+    return path != NULL ? path : getenv("PATH");
+}
+
+// Search each $PATH directory for an executable file called name
+char* find_in_path(const char* name) {
+    const char* dirs = search_path();
+    if (dirs == NULL) {
+        dirs = "/usr/local/bin:/usr/bin:/bin";
+    }
+    size_t name_len = strlen(name);
+    char buf[PATH_MAX];
+    struct stat st;
+
+    while (*dirs != '\0') {
+        const char* end = strchr(dirs, ':');
+        size_t dir_len = end ? (size_t)(end - dirs) : strlen(dirs);
+        // An empty PATH element means the current directory
+        if (dir_len == 0) {
+            buf[0] = '.';
+            dir_len = 1;
+        } else if (dir_len < sizeof(buf)) {
+            memcpy(buf, dirs, dir_len);
+        }
+        if (dir_len + name_len + 2 <= sizeof(buf)) {
+            buf[dir_len] = '/';
+            memcpy(buf + dir_len + 1, name, name_len + 1);
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0) {
+                return xstrdup(buf);
+            }
+        }
+        if (end == NULL) break;
+        dirs = end + 1;
+    }
+    return NULL;
+}
+
+// Return the absolute path for a command, resolving and caching it on a miss
+char* hash_lookup(const char* name) {
+    // Names with a slash are used as given, like execvp does
+    if (strchr(name, '/') != NULL) {
+        return (char*)name;
+    }
+    // Everything cached was resolved against the old PATH
+    const char* path_env = search_path();
+    if (path_env == NULL) path_env = "";
+    if (cmd_hash_path == NULL || strcmp(cmd_hash_path, path_env) != 0) {
+        hash_clear();
+        free(cmd_hash_path);
+        cmd_hash_path = xstrdup(path_env);
+    }
+
+    if (cmd_hash_size > 0) {
+        unsigned long i = hash_str(name) & (cmd_hash_size - 1);
+        while (cmd_hash[i].name != NULL) {
+            if (strcmp(cmd_hash[i].name, name) == 0) {
+                cmd_hash[i].hits++;
+                cmd_hash_hits++;
+                return cmd_hash[i].path;
+            }
+            i = (i + 1) & (cmd_hash_size - 1);
+        }
+    }
+    cmd_hash_misses++;
+    char* path = find_in_path(name);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    // Grow at 3/4 load so probe sequences stay short
+    if ((cmd_hash_count + 1) * 4 > cmd_hash_size * 3) {
+        int old_size = cmd_hash_size;
+        HashEntry* old = cmd_hash;
+        cmd_hash_size = old_size ? old_size * 2 : HASH_INIT_SIZE;
+        cmd_hash = xcalloc(cmd_hash_size, sizeof(HashEntry));
+        for (int j = 0; j < old_size; j++) {
+            if (old[j].name != NULL) {
+                unsigned long k = hash_str(old[j].name) & (cmd_hash_size - 1);
+                while (cmd_hash[k].name != NULL) k = (k + 1) & (cmd_hash_size - 1);
+                cmd_hash[k] = old[j];
+            }
+        }
+        free(old);
+    }
+    unsigned long i = hash_str(name) & (cmd_hash_size - 1);
+    while (cmd_hash[i].name != NULL) i = (i + 1) & (cmd_hash_size - 1);
+    cmd_hash[i].name = xstrdup(name);
+    cmd_hash[i].path = path;
+    cmd_hash[i].hits = 1;
+    cmd_hash_count++;
+    return path;
+}
+
+// Drop one cached command, shifting later entries of its probe run back into place
+void hash_remove(const char* name) {
+    if (cmd_hash_size == 0) return;
+    unsigned long mask = cmd_hash_size - 1;
+    unsigned long i = hash_str(name) & mask;
+    while (cmd_hash[i].name != NULL && strcmp(cmd_hash[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    if (cmd_hash[i].name == NULL) return;
+    free(cmd_hash[i].name);
+    free(cmd_hash[i].path);
+    cmd_hash[i].name = NULL;
+    cmd_hash_count--;
+
+    unsigned long j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (cmd_hash[j].name == NULL) break;
+        unsigned long home = hash_str(cmd_hash[j].name) & mask;
+        // Move the entry back if its home slot is not between the hole and j
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            cmd_hash[i] = cmd_hash[j];
+            cmd_hash[j].name = NULL;
+            i = j;
+        }
+    }
+}
+
+// Forget every cached command location
+void hash_clear() {
+    for (int i = 0; i < cmd_hash_size; i++) {
+        if (cmd_hash[i].name != NULL) {
+            free(cmd_hash[i].name);
+            free(cmd_hash[i].path);
+            cmd_hash[i].name = NULL;
+        }
+    }
+    cmd_hash_count = 0;
+}
+
+// hash: list the cache, hash -r: clear it, hash name...: resolve names into it
+int hash_builtin(char* cmd[], Out* out) {
+    int status = 0;
+    if (cmd[1] == NULL) {
+        if (cmd_hash_count == 0) {
+            out_puts(out, "hash: hash table empty\n");
+        } else {
+            out_puts(out, "hits\tcommand\n");
+            for (int i = 0; i < cmd_hash_size; i++) {
+                if (cmd_hash[i].name != NULL) {
+                    out_printf(out, "%4d\t%s\n", cmd_hash[i].hits, cmd_hash[i].path);
+                }
+            }
+        }
+        out_printf(out, "hash: %ld hits, %ld misses\n", cmd_hash_hits, cmd_hash_misses);
+        return 0;
+    }
+    if (strcmp(cmd[1], "-r") == 0) {
+        hash_clear();
+        cmd_hash_hits = 0;
+        cmd_hash_misses = 0;
+        return 0;
+    }
+    for (int i = 1; cmd[i] != NULL; i++) {
+        if (hash_lookup(cmd[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", cmd[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Parse a command line into a tree in the command arena:
+//   list     := and_or (( ';' | '&' | newline ) and_or)* [ ';' | '&' | newline ]
+//   and_or   := pipeline (( '&&' | '||' ) pipeline)*
+//   pipeline := [ '!' ] command ( '|' command )*
+//   command  := simple | compound redir*
+//   compound := '(' list ')' | '{' list '}' | if | while | for
+//   if       := 'if' list 'then' list ( 'elif' list 'then' list )* [ 'else' list ] 'fi'
+//   while    := ( 'while' | 'until' ) list 'do' list 'done'
+//   for      := 'for' name [ 'in' word* ( ';' | newline ) ] 'do' list 'done'
+//   simple   := ( word | redir )+
+//   redir    := ( '<' | '>' | '>>' ) word
+// Reserved words only count unquoted and where a command starts. Newlines may also follow
+// '|', '&&', '||' and the words that open a list. Returns NULL for a blank line; after
+// reporting a syntax error with *status set to 2; or with *status set to PARSE_MORE when
+// the line ends inside a command, so the caller can add the next one and try again.
+Node* parse_tree(const char* line, Shell* sh, int* status) {
+    Parser ps;
+    ps.src = line;
+    ps.pos = 0;
+    ps.error = 0;
+    ps.incomplete = 0;
+    ps.arena = &cmd_arena;
+    ps.sh = sh;
+    ps.naliases = 0;
+    lex(&ps);
+    skip_newlines(&ps);
+    if (ps.tok == TOK_END && !ps.error) return NULL;
+    Node* tree = parse_list(&ps);
+    if (ps.tok != TOK_END) parse_error(&ps, NULL);
+    if (ps.error) {
+        *status = ps.incomplete ? PARSE_MORE : 2;
+        return NULL;
+    }
+    return tree;
+}
+
+// parse_tree() through the parse cache: a line seen before reuses its tree, a new one is
+// parsed and a copy kept. The tree returned must not be changed.
+Node* parse_line(const char* line, Shell* sh, int* status) {
+    unsigned long hash = hash_str(line);
+    Node* tree = parse_cache_stale ? NULL : parse_cache_find(line, hash);
+    if (tree != NULL) {
+        parse_cache_hits++;
+        return tree;
+    }
+    parse_cache_misses++;
+    tree = parse_tree(line, sh, status);
+    if (tree == NULL || parse_cache_stale || parse_cache_count >= PARSE_CACHE_SLOTS * 3 / 4) return tree;
+    return parse_cache_store(line, hash, tree);
+}
+
+Node* parse_cache_find(const char* line, unsigned long hash) {
+    unsigned long i = hash & (PARSE_CACHE_SLOTS - 1);
+    CacheEntry* e;
+    while ((e = parse_cache[i]) != NULL) {
+        if (e->hash == hash && strcmp(e->line, line) == 0) {
+            // Most recently used goes to the end of the list
+            if (e != parse_cache_newest) {
+                if (e->older != NULL) {
+                    e->older->newer = e->newer;
+                } else {
+                    parse_cache_oldest = e->newer;
+                }
+                e->newer->older = e->older;
+                e->older = parse_cache_newest;
+                e->newer = NULL;
+                parse_cache_newest->newer = e;
+                parse_cache_newest = e;
+            }
+            return e->tree;
+        }
+        i = (i + 1) & (PARSE_CACHE_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Copy a freshly parsed tree out of the command arena into a new entry and return the copy
+Node* parse_cache_store(const char* line, unsigned long hash, Node* tree) {
+    size_t len = strlen(line);
+    CacheEntry* e = xmalloc(sizeof(CacheEntry));
+    arena_init(&e->store, ARENA_ALIGN(len + 1) + node_size(tree));
+    e->hash = hash;
+    e->line = arena_strndup(&e->store, line, len);
+    e->tree = node_copy(tree, &e->store);
+    e->newer = NULL;
+    e->older = parse_cache_newest;
+    if (parse_cache_newest != NULL) {
+        parse_cache_newest->newer = e;
+    } else {
+        parse_cache_oldest = e;
+    }
+    parse_cache_newest = e;
+    unsigned long i = hash & (PARSE_CACHE_SLOTS - 1);
+    while (parse_cache[i] != NULL) i = (i + 1) & (PARSE_CACHE_SLOTS - 1);
+    parse_cache[i] = e;
+    parse_cache_count++;
+    parse_cache_bytes += sizeof(CacheEntry) + e->store.total;
+    return e->tree;
+}
+
+// Unlink an entry and free it; later slots of its probe run move back into place
+void parse_cache_remove(CacheEntry* e) {
+    unsigned long mask = PARSE_CACHE_SLOTS - 1;
+    unsigned long i = e->hash & mask;
+    while (parse_cache[i] != e) i = (i + 1) & mask;
+    parse_cache[i] = NULL;
+    unsigned long j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (parse_cache[j] == NULL) break;
+        unsigned long home = parse_cache[j]->hash & mask;
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            parse_cache[i] = parse_cache[j];
+            parse_cache[j] = NULL;
+            i = j;
+        }
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        parse_cache_oldest = e->newer;
+    }
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        parse_cache_newest = e->older;
+    }
+    parse_cache_count--;
+    parse_cache_bytes -= sizeof(CacheEntry) + e->store.total;
+    arena_free(&e->store);
+    free(e);
+}
+
+// Between lines: drop everything if an alias changed, then least recently used entries
+// until the cache is back within its memory and slot budget
+void parse_cache_trim() {
+    while (parse_cache_oldest != NULL &&
+           (parse_cache_stale || parse_cache_bytes > PARSE_CACHE_BYTES || parse_cache_count > PARSE_CACHE_SLOTS / 2)) {
+        parse_cache_remove(parse_cache_oldest);
+    }
+    parse_cache_stale = 0;
+}
+
+// Report the first syntax error only; without msg it names the token it was found at.
+// Running out of input there is not reported: the caller may have more lines to add.
+void parse_error(Parser* ps, const char* msg) {
+    if (ps->error) return;
+    ps->error = 1;
+    if (msg != NULL) {
+        fprintf(stderr, "syntax error: %s\n", msg);
+    } else if (ps->tok == TOK_END) {
+        ps->incomplete = 1;
+    } else if (ps->tok == TOK_NEWLINE) {
+        fprintf(stderr, "syntax error: unexpected newline\n");
+    } else {
+        fprintf(stderr, "syntax error: unexpected '%.*s'\n", (int)ps->len, ps->src + ps->start);
+    }
+}
+
+const char* keywords[KW_COUNT] = {
+    "", "{", "!", "if", "while", "until", "for", "in", "}", "then", "elif", "else", "fi", "do", "done",
+};
+
+// First bytes of reserved words, so most words are not compared with any
+const unsigned char keyword_start[256] = {
+    ['{'] = 1, ['!'] = 1, ['i'] = 1, ['w'] = 1, ['u'] = 1, ['f'] = 1, ['}'] = 1, ['t'] = 1,
+    ['e'] = 1, ['d'] = 1,
+};
+
+// Bytes that end a run of ordinary characters in a word: the end of the input, blanks,
+// newlines, operator characters, quotes, backslash, $ and backquote
+const unsigned char lex_stop[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['|'] = 1, ['&'] = 1, [';'] = 1, ['('] = 1, [')'] = 1,
+    ['<'] = 1, ['>'] = 1, ['\''] = 1, ['"'] = 1, ['\\'] = 1, ['$'] = 1, ['`'] = 1,
+};
+
+// Read the next token. A word runs to an unquoted blank, newline or operator character;
+// its quotes, backslashes and substitutions are only stepped over here and dealt with
+// when it is expanded.
+// A # at the start of a word begins a comment, and a backslash before a newline joins the
+// lines. Quotes and backslashes left open at the end are reported as the end of input.
+void lex(Parser* ps) {
+    const char* s = ps->src;
+    size_t i = ps->pos;
+    for (;;) {
+        while (s[i] == ' ' || s[i] == '\t') i++;
+        if (s[i] != '\\' || s[i + 1] != '\n') break;
+        i += 2;
+    }
+    if (s[i] == '#') {
+        while (s[i] != '\0' && s[i] != '\n') i++;
+    }
+    ps->start = i;
+    ps->plain = 1;
+    ps->keyword = KW_NONE;
+    char c = s[i];
+    if (c == '\0' || c == '\n') {
+        ps->tok = c == '\0' ? TOK_END : TOK_NEWLINE;
+        ps->len = c == '\n';
+        ps->pos = i + ps->len;
+        return;
+    }
+    if (strchr("|&;()<>", c) != NULL) {
+        int twice = s[i + 1] == c && (c == '|' || c == '&' || c == '>');
+        switch (c) {
+        case '|': ps->tok = twice ? TOK_OR_IF : TOK_PIPE; break;
+        case '&': ps->tok = twice ? TOK_AND_IF : TOK_AMP; break;
+        case ';': ps->tok = TOK_SEMI; break;
+        case '(': ps->tok = TOK_LPAREN; break;
+        case ')': ps->tok = TOK_RPAREN; break;
+        case '<': ps->tok = TOK_LESS; break;
+        default:  ps->tok = twice ? TOK_DGREAT : TOK_GREAT; break;
+        }
+        ps->len = 1 + twice;
+        ps->pos = i + ps->len;
+        return;
+    }
+    char open_quote = 0;
+    for (;;) {
+        while (!lex_stop[(unsigned char)s[i]]) i++;
+        if (s[i] == '\0' || s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || strchr("|&;()<>", s[i]) != NULL) break;
+        if (s[i] == '\'') {
+            const char* end = strchr(s + i + 1, '\'');
+            if (end == NULL) {
+                open_quote = '\'';
+                break;
+            }
+            i = end - s + 1;
+            ps->plain = 0;
+        } else if (s[i] == '"') {
+            const char* end = dquote_end(s + i);
+            if (end == NULL) {
+                open_quote = '"';
+                break;
+            }
+            i = end - s;
+            ps->plain = 0;
+        } else if (s[i] == '\\') {
+            if (s[i + 1] == '\0') {
+                open_quote = '\\';
+                break;
+            }
+            i += 2;
+            ps->plain = 0;
+        } else {  // $ or `
+            ps->plain = 0;
+            if (s[i] == '`' || s[i + 1] == '(') {
+                const char* end = subst_end(s + i);
+                if (end == NULL) {
+                    open_quote = s[i];
+                    break;
+                }
+                i = end - s;
+            } else {
+                i++;
+            }
+        }
+    }
+    if (open_quote) {
+        ps->tok = TOK_END;
+        ps->len = 0;
+        ps->pos = strlen(s);
+        parse_error(ps, NULL);
+        return;
+    }
+    ps->tok = TOK_WORD;
+    ps->len = i - ps->start;
+    ps->pos = i;
+    if (ps->plain && ps->len <= 5 && keyword_start[(unsigned char)c]) {
+        for (int k = 1; k < KW_COUNT; k++) {
+            if (keywords[k][0] == c && strncmp(keywords[k], s + ps->start, ps->len) == 0 && keywords[k][ps->len] == '\0') {
+                ps->keyword = k;
+                break;
+            }
+        }
+    }
+}
+
+// End of the double-quoted string starting at p, just past its closing quote; NULL when
+// the text ends first. Substitutions inside may hold quotes of their own.
+const char* dquote_end(const char* p) {
+    for (p++; *p != '"'; p++) {
+        if (*p == '\0') return NULL;
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '`' || (*p == '$' && p[1] == '(')) {
+            const char* end = subst_end(p);
+            if (end == NULL) return NULL;
+            p = end - 1;
+        }
+    }
+    return p + 1;
+}
+
+// End of the $( ), $(( )) or `` ` `` substitution starting at p, just past it; NULL when
+// the text ends first. Inside $( ) quotes, backslashes and nested substitutions are
+// stepped over, so only the command's own parentheses count.
+const char* subst_end(const char* p) {
+    const char* end;
+    if (*p == '`') {
+        for (p++; *p != '`'; p++) {
+            if (*p == '\0') return NULL;
+            if (*p == '\\' && p[1] != '\0') p++;
+        }
+        return p + 1;
+    }
+    if (p[2] == '(') return arith_end(p);
+    int depth = 0;
+    for (p++; *p != '\0'; p++) {
+        switch (*p) {
+        case '(':
+            depth++;
+            break;
+        case ')':
+            if (--depth == 0) return p + 1;
+            break;
+        case '\'':
+            if ((p = strchr(p + 1, '\'')) == NULL) return NULL;
+            break;
+        case '"':
+            if ((end = dquote_end(p)) == NULL) return NULL;
+            p = end - 1;
+            break;
+        case '\\':
+            if (p[1] != '\0') p++;
+            break;
+        case '$':
+        case '`':
+            if (*p == '`' || p[1] == '(') {
+                if ((end = subst_end(p)) == NULL) return NULL;
+                p = end - 1;
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+Node* node_new(Parser* ps, int type) {
+    Node* node = arena_alloc(ps->arena, sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    return node;
+}
+
+int list_end(Parser* ps) {
+    return ps->tok == TOK_END || ps->tok == TOK_RPAREN || ps->keyword >= KW_RBRACE;
+}
+
+void skip_newlines(Parser* ps) {
+    while (ps->tok == TOK_NEWLINE) lex(ps);
+}
+
+// Step over the reserved word given, or report what is there instead
+int expect(Parser* ps, int keyword) {
+    if (ps->keyword != keyword) {
+        parse_error(ps, NULL);
+        return 0;
+    }
+    lex(ps);
+    return 1;
+}
+
+// A list ends at the end of the input or at what closes a subshell, group, if or loop part
+Node* parse_list(Parser* ps) {
+    Node* first = NULL;
+    Node** tail = &first;
+    int n = 0;
+    skip_newlines(ps);
+    while (!list_end(ps)) {
+        size_t start = ps->start;
+        Node* item = parse_and_or(ps);
+        if (item == NULL) return NULL;
+        if (ps->tok == TOK_AMP) {
+            // Keep the text for jobs, as typed up to the &
+            size_t end = ps->start;
+            while (end > start && (ps->src[end - 1] == ' ' || ps->src[end - 1] == '\t')) end--;
+            item->flags |= NODE_BACKGROUND;
+            item->text = arena_alloc(ps->arena, end - start + 3);
+            memcpy(item->text, ps->src + start, end - start);
+            memcpy(item->text + (end - start), " &", 3);
+        }
+        *tail = item;
+        tail = &item->next;
+        n++;
+        if (ps->tok != TOK_SEMI && ps->tok != TOK_AMP && ps->tok != TOK_NEWLINE) break;
+        lex(ps);
+        skip_newlines(ps);
+    }
+    if (n == 0) {
+        parse_error(ps, NULL);
+        return NULL;
+    }
+    if (n == 1 && !(first->flags & NODE_BACKGROUND)) return first;
+    Node* list = node_new(ps, NODE_LIST);
+    list->kids = first;
+    list->n = n;
+    return list;
+}
+
+// && and || bind equally and to the left
+Node* parse_and_or(Parser* ps) {
+    Node* left = parse_pipeline(ps);
+    while (left != NULL && (ps->tok == TOK_AND_IF || ps->tok == TOK_OR_IF)) {
+        Node* node = node_new(ps, ps->tok == TOK_AND_IF ? NODE_AND : NODE_OR);
+        lex(ps);
+        skip_newlines(ps);
+        Node* right = parse_pipeline(ps);
+        if (right == NULL) return NULL;
+        node->kids = left;
+        left->next = right;
+        left = node;
+    }
+    return left;
+}
+
+// A single command is returned as is unless ! applies to it
+Node* parse_pipeline(Parser* ps) {
+    int negate = 0;
+    if (ps->keyword == KW_BANG) {
+        negate = 1;
+        lex(ps);
+    }
+    Node* first = parse_command(ps);
+    if (first == NULL) return NULL;
+    Node* last = first;
+    int n = 1;
+    while (ps->tok == TOK_PIPE) {
+        lex(ps);
+        skip_newlines(ps);
+        Node* next = parse_command(ps);
+        if (next == NULL) return NULL;
+        last->next = next;
+        last = next;
+        n++;
+    }
+    if (n == 1 && !negate) return first;
+    Node* pipe = node_new(ps, NODE_PIPE);
+    pipe->flags = negate ? NODE_NEGATE : 0;
+    pipe->kids = first;
+    pipe->n = n;
+    return pipe;
+}
+
+Node* parse_command(Parser* ps) {
+    Node* node;
+    if (ps->tok == TOK_LPAREN || ps->keyword == KW_LBRACE) {
+        int type = ps->tok == TOK_LPAREN ? NODE_SUBSHELL : NODE_GROUP;
+        node = node_new(ps, type);
+        lex(ps);
+        node->kids = parse_list(ps);
+        if (node->kids == NULL) return NULL;
+        if (type == NODE_SUBSHELL ? ps->tok != TOK_RPAREN : ps->keyword != KW_RBRACE) {
+            parse_error(ps, NULL);
+            return NULL;
+        }
+        lex(ps);
+    } else if (ps->keyword == KW_IF) {
+        node = parse_if(ps);
+    } else if (ps->keyword == KW_WHILE || ps->keyword == KW_UNTIL) {
+        node = parse_while(ps);
+    } else if (ps->keyword == KW_FOR) {
+        node = parse_for(ps);
+    } else {
+        return parse_simple(ps);
+    }
+    if (node == NULL) return NULL;
+    Redir** tail = &node->redirs;
+    while (ps->tok == TOK_LESS || ps->tok == TOK_GREAT || ps->tok == TOK_DGREAT) {
+        if ((*tail = parse_redir(ps)) == NULL) return NULL;
+        tail = &(*tail)->next;
+    }
+    return node;
+}
+
+// if and elif: condition, then part and an optional else part in kids. An elif is parsed
+// as an if in the else part, and its fi is the outer one.
+Node* parse_if(Parser* ps) {
+    Node* node = node_new(ps, NODE_IF);
+    lex(ps);
+    Node* cond = parse_list(ps);
+    if (cond == NULL || !expect(ps, KW_THEN)) return NULL;
+    Node* body = parse_list(ps);
+    if (body == NULL) return NULL;
+    node->kids = cond;
+    cond->next = body;
+    if (ps->keyword == KW_ELIF) {
+        body->next = parse_if(ps);
+        return body->next != NULL ? node : NULL;
+    }
+    if (ps->keyword == KW_ELSE) {
+        lex(ps);
+        if ((body->next = parse_list(ps)) == NULL) return NULL;
+    }
+    return expect(ps, KW_FI) ? node : NULL;
+}
+
+Node* parse_while(Parser* ps) {
+    Node* node = node_new(ps, NODE_WHILE);
+    if (ps->keyword == KW_UNTIL) node->flags = NODE_UNTIL;
+    lex(ps);
+    Node* cond = parse_list(ps);
+    if (cond == NULL || !expect(ps, KW_DO)) return NULL;
+    Node* body = parse_list(ps);
+    if (body == NULL || !expect(ps, KW_DONE)) return NULL;
+    node->kids = cond;
+    cond->next = body;
+    return node;
+}
+
+// for name [in word...]: words holds the name, then the words to loop over, which are
+// "$@" when there is no in
+Node* parse_for(Parser* ps) {
+    char* local[32];
+    char** words = local;
+    int n = 0, cap = 32;
+    Node* node = node_new(ps, NODE_FOR);
+    node->flags = NODE_PLAIN;
+    lex(ps);
+    if (ps->tok != TOK_WORD || !ps->plain || name_length(ps->src + ps->start) != ps->len) {
+        parse_error(ps, ps->tok == TOK_WORD ? "bad for loop variable" : NULL);
+        return NULL;
+    }
+    words[n++] = arena_strndup(ps->arena, ps->src + ps->start, ps->len);
+    lex(ps);
+    skip_newlines(ps);
+    if (ps->keyword == KW_IN) {
+        lex(ps);
+        while (ps->tok == TOK_WORD) {
+            if (n == cap) {
+                char** grown = arena_alloc(ps->arena, sizeof(char*) * cap * 2);
+                memcpy(grown, words, sizeof(char*) * n);
+                words = grown;
+                cap *= 2;
+            }
+            if (!ps->plain) node->flags &= ~NODE_PLAIN;
+            words[n++] = arena_strndup(ps->arena, ps->src + ps->start, ps->len);
+            lex(ps);
+        }
+        if (ps->tok != TOK_SEMI && ps->tok != TOK_NEWLINE) {
+            parse_error(ps, NULL);
+            return NULL;
+        }
+        lex(ps);
+    } else {
+        words[n++] = arena_strndup(ps->arena, "\"$@\"", 4);
+        node->flags = 0;
+        if (ps->tok == TOK_SEMI) lex(ps);
+    }
+    skip_newlines(ps);
+    if (!expect(ps, KW_DO)) return NULL;
+    node->kids = parse_list(ps);
+    if (node->kids == NULL || !expect(ps, KW_DONE)) return NULL;
+    node->n = n;
+    node->words = arena_alloc(ps->arena, sizeof(char*) * (n + 1));
+    memcpy(node->words, words, sizeof(char*) * n);
+    node->words[n] = NULL;
+    return node;
+}
+
+// Words and redirections in any order; an alias in command position is replaced by its
+// text before anything else is read
+Node* parse_simple(Parser* ps) {
+    char* local[32];
+    char** words = local;
+    int n = 0, cap = 32;
+    Node* node = node_new(ps, NODE_CMD);
+    Redir** tail = &node->redirs;
+    node->flags = NODE_PLAIN;
+    for (;;) {
+        if (ps->tok == TOK_WORD) {
+            if (n == 0 && ps->plain && alias_expand(ps)) continue;
+            if (n == cap) {
+                char** grown = arena_alloc(ps->arena, sizeof(char*) * cap * 2);
+                memcpy(grown, words, sizeof(char*) * n);
+                words = grown;
+                cap *= 2;
+            }
+            if (!ps->plain) node->flags &= ~NODE_PLAIN;
+            words[n++] = arena_strndup(ps->arena, ps->src + ps->start, ps->len);
+            lex(ps);
+        } else if (ps->tok == TOK_LESS || ps->tok == TOK_GREAT || ps->tok == TOK_DGREAT) {
+            if ((*tail = parse_redir(ps)) == NULL) return NULL;
+            tail = &(*tail)->next;
+        } else {
+            break;
+        }
+    }
+    if (n == 0 && node->redirs == NULL) {
+        parse_error(ps, NULL);
+        return NULL;
+    }
+    node->n = n;
+    node->words = arena_alloc(ps->arena, sizeof(char*) * (n + 1));
+    memcpy(node->words, words, sizeof(char*) * n);
+    node->words[n] = NULL;
+    return node;
+}
+
+Redir* parse_redir(Parser* ps) {
+    Redir* r = arena_alloc(ps->arena, sizeof(Redir));
+    r->fd = ps->tok == TOK_LESS ? 0 : 1;
+    r->append = ps->tok == TOK_DGREAT;
+    r->next = NULL;
+    lex(ps);
+    if (ps->tok != TOK_WORD) {
+        parse_error(ps, ps->tok == TOK_END ? "expected a file name after a redirection" : NULL);
+        return NULL;
+    }
+    r->word = arena_strndup(ps->arena, ps->src + ps->start, ps->len);
+    lex(ps);
+    return r;
+}
+
+// If the current word names an alias, splice its text into the line in place of the
+// name and read on from there. An alias is not expanded again inside its own text, so
+// `alias ls=ls -F` stops after one round.
+int alias_expand(Parser* ps) {
+    char name[ARGLEN];
+    if (ps->len >= ARGLEN || *ps->sh->alias_count == 0) return 0;
+    memcpy(name, ps->src + ps->start, ps->len);
+    name[ps->len] = '\0';
+    // Aliases whose text has been read past no longer count
+    while (ps->naliases > 0 && ps->alias_ends[ps->naliases - 1] <= ps->start) ps->naliases--;
+    for (int k = 0; k < ps->naliases; k++) {
+        if (strcmp(ps->alias_names[k], name) == 0) return 0;
+    }
+    const char* value = get_alias(name, ps->sh->aliases, *ps->sh->alias_count);
+    if (value == NULL || ps->naliases == MAX_ALIASES) return 0;
+
+    size_t value_len = strlen(value);
+    size_t rest = strlen(ps->src + ps->pos);
+    char* src = arena_alloc(ps->arena, ps->start + value_len + rest + 1);
+    memcpy(src, ps->src, ps->start);
+    memcpy(src + ps->start, value, value_len);
+    memcpy(src + ps->start + value_len, ps->src + ps->pos, rest + 1);
+    // Enclosing aliases' text moved along with everything after the name
+    for (int k = 0; k < ps->naliases; k++) {
+        ps->alias_ends[k] += value_len - ps->len;
+    }
+    strcpy(ps->alias_names[ps->naliases], name);
+    ps->alias_ends[ps->naliases++] = ps->start + value_len;
+    ps->src = src;
+    ps->pos = ps->start;
+    lex(ps);
+    return 1;
+}
+
+// Arena bytes node_copy() takes for a tree
+size_t node_size(Node* node) {
+    size_t size = ARENA_ALIGN(sizeof(Node));
+    if (node->words != NULL) {
+        size += ARENA_ALIGN(sizeof(char*) * (node->n + 1));
+        for (int i = 0; i < node->n; i++) size += ARENA_ALIGN(strlen(node->words[i]) + 1);
+    }
+    if (node->text != NULL) size += ARENA_ALIGN(strlen(node->text) + 1);
+    for (Redir* r = node->redirs; r != NULL; r = r->next) {
+        size += ARENA_ALIGN(sizeof(Redir)) + ARENA_ALIGN(strlen(r->word) + 1);
+    }
+    for (Node* k = node->kids; k != NULL; k = k->next) size += node_size(k);
+    return size;
+}
+
+// Deep copy of a command tree: node and everything below it, not the nodes after it
+Node* node_copy(Node* node, Arena* arena) {
+    Node* copy = arena_alloc(arena, sizeof(Node));
+    *copy = *node;
+    copy->next = NULL;
+    if (node->words != NULL) {
+        copy->words = arena_alloc(arena, sizeof(char*) * (node->n + 1));
+        for (int i = 0; i < node->n; i++) {
+            copy->words[i] = arena_strndup(arena, node->words[i], strlen(node->words[i]));
+        }
+        copy->words[node->n] = NULL;
+    }
+    if (node->text != NULL) {
+        copy->text = arena_strndup(arena, node->text, strlen(node->text));
+    }
+    Redir** tail = &copy->redirs;
+    for (Redir* r = node->redirs; r != NULL; r = r->next) {
+        *tail = arena_alloc(arena, sizeof(Redir));
+        **tail = *r;
+        (*tail)->word = arena_strndup(arena, r->word, strlen(r->word));
+        tail = &(*tail)->next;
+    }
+    Node** kid = &copy->kids;
+    for (Node* k = node->kids; k != NULL; k = k->next) {
+        *kid = node_copy(k, arena);
+        kid = &(*kid)->next;
+    }
+    return copy;
+}
+
+// Read command input from user; the line lives in the reader's buffer until the next call
+char* read_cmd(char* prompt, LineReader* reader, History* history) {
+    if (interactive) {
+        fflush(stdout);
+        return edit_line(prompt, history);
+    }
+    return read_line(reader);
+}
+
+// Keys edit_line() handles beyond plain bytes
+#define KEY_UP 1001
+#define KEY_DOWN 1002
+#define KEY_LEFT 1003
+#define KEY_RIGHT 1004
+#define KEY_ESC 1005
+
+// Read one key from the terminal, folding arrow-key escape sequences into one code
+int read_key() {
+    unsigned char c, seq[2];
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR);
+    if (n <= 0) return -1;
+    if (c != 27) return c;
+
+    // A lone ESC is not followed by anything straight away
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&pfd, 1, 30) <= 0 || read(STDIN_FILENO, &seq[0], 1) != 1) return KEY_ESC;
+    if ((seq[0] != '[' && seq[0] != 'O') || read(STDIN_FILENO, &seq[1], 1) != 1) return KEY_ESC;
+    switch (seq[1]) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    }
+    return KEY_ESC;
+}
+
+// Output for the editor goes straight to the terminal
+void term_write(const char* str, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, str, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        str += n;
+        len -= n;
+    }
+}
+
+void term_puts(const char* str) {
+    term_write(str, strlen(str));
+}
+
+// Redraw the prompt and line, leaving the cursor at pos
+void refresh_line(const char* prompt, const char* buf, size_t len, size_t pos) {
+    char move[32];
+    term_puts("\r\x1b[K");
+    term_puts(prompt);
+    term_write(buf, len);
+    if (pos < len) {
+        snprintf(move, sizeof(move), "\x1b[%zuD", len - pos);
+        term_puts(move);
+    }
+}
+
+// Line buffer filled by edit_line()
+char* edit_buf = NULL;
+size_t edit_cap = 0;
+
+void edit_set(size_t* len, size_t* pos, const char* text) {
+    size_t n = strlen(text);
+    if (n + 1 > edit_cap) {
+        edit_cap = n + 256;
+        edit_buf = xrealloc(edit_buf, edit_cap);
+    }
+    memcpy(edit_buf, text, n + 1);
+    *len = n;
+    *pos = n;
+}
+
+// Interactive line input with basic editing, arrow-key history and Ctrl-R reverse search.
+// Returns NULL at end of input (Ctrl-D on an empty line).
+char* edit_line(const char* prompt, History* history) {
+    struct termios saved, raw;
+    size_t len = 0, pos = 0;
+    long browse = history->next;    // Event shown by Up/Down, next means the line being typed
+    char* result = NULL;
+
+    if (tcgetattr(STDIN_FILENO, &saved) < 0) {
+        // Not a real terminal after all
+        term_puts(prompt);
+        return read_line(&input);
+    }
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);  // DRAIN, not FLUSH: keep what was typed ahead
+
+    edit_set(&len, &pos, "");
+    term_puts(prompt);
+    while (1) {
+        int key = read_key();
+        if (key == '\r' || key == '\n') {
+            term_puts("\n");
+            result = edit_buf;
+            break;
+        } else if (key == -1 || (key == 4 && len == 0)) {  // Ctrl-D
+            result = NULL;
+            break;
+        } else if (key == 3) {  // Ctrl-C drops the line
+            term_puts("^C\n");
+            edit_set(&len, &pos, "");
+            browse = history->next;
+        } else if (key == 127 || key == 8) {
+            if (pos > 0) {
+                memmove(edit_buf + pos - 1, edit_buf + pos, len - pos + 1);
+                pos--;
+                len--;
+            }
+        } else if (key == 4) {
+            if (pos < len) {
+                memmove(edit_buf + pos, edit_buf + pos + 1, len - pos);
+                len--;
+            }
+        } else if (key == 1) {  // Ctrl-A
+            pos = 0;
+        } else if (key == 5) {  // Ctrl-E
+            pos = len;
+        } else if (key == 21) {  // Ctrl-U
+            edit_set(&len, &pos, "");
+        } else if (key == KEY_LEFT) {
+            if (pos > 0) pos--;
+        } else if (key == KEY_RIGHT) {
+            if (pos < len) pos++;
+        } else if (key == KEY_UP || key == KEY_DOWN) {
+            long event = browse + (key == KEY_UP ? -1 : 1);
+            if (event >= history->first && event < history->next) {
+                browse = event;
+                edit_set(&len, &pos, history_get(history, event));
+            } else if (event >= history->next) {
+                browse = history->next;
+                edit_set(&len, &pos, "");
+            }
+        } else if (key == 18) {  // Ctrl-R
+            char query[256];
+            size_t qlen = 0;
+            long results[SEARCH_RESULTS];
+            int nres = 0, index = 0, accept = 0;
+            char* original = arena_strndup(&cmd_arena, edit_buf, len);
+            query[0] = '\0';
+            while (1) {
+                char* match = index < nres ? history_get(history, results[index]) : "";
+                term_puts("\r\x1b[K(reverse-i-search)`");
+                term_write(query, qlen);
+                term_puts(nres == 0 && qlen > 0 ? "' (no match): " : "': ");
+                term_puts(match);
+
+                key = read_key();
+                if (key >= 32 && key < 127 && qlen + 1 < sizeof(query)) {
+                    query[qlen++] = key;
+                    query[qlen] = '\0';
+                } else if ((key == 127 || key == 8) && qlen > 0) {
+                    query[--qlen] = '\0';
+                } else if (key == 18) {
+                    if (index + 1 < nres) index++;
+                    continue;
+                } else if (key == 3 || key == 7 || key == -1) {  // Ctrl-C / Ctrl-G cancel
+                    edit_set(&len, &pos, original);
+                    break;
+                } else {
+                    // Enter runs the match; anything else puts it on the line for editing
+                    if (nres > 0) edit_set(&len, &pos, match);
+                    accept = (key == '\r' || key == '\n');
+                    break;
+                }
+                nres = history_search(history, query, results, SEARCH_RESULTS);
+                index = 0;
+            }
+            if (accept) {
+                refresh_line(prompt, edit_buf, len, pos);
+                term_puts("\n");
+                result = edit_buf;
+                break;
+            }
+        } else if (key >= 32 && key < 256 && key != 127) {
+            if (len + 2 > edit_cap) {
+                edit_cap = edit_cap * 2 + 256;
+                edit_buf = xrealloc(edit_buf, edit_cap);
+            }
+            memmove(edit_buf + pos + 1, edit_buf + pos, len - pos + 1);
+            edit_buf[pos++] = key;
+            len++;
+        }
+        refresh_line(prompt, edit_buf, len, pos);
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    return result;
+}
+
+void reader_init(LineReader* reader, int fd) {
+    reader->fd = fd;
+    reader->cap = READ_CHUNK;
+    reader->buf = xmalloc(reader->cap + 1);
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+}
+
+// Serve lines from a string, as for shell -c; no read(2) calls are made
+void reader_init_string(LineReader* reader, const char* str) {
+    reader->fd = -1;
+    reader->end = strlen(str);
+    reader->cap = reader->end;
+    reader->buf = xmalloc(reader->cap + 1);
+    memcpy(reader->buf, str, reader->end);
+    reader->start = 0;
+    reader->eof = 1;
+}
+
+// Value of a special parameter ($?, $#, $0-$9), or NULL if c does not name one
+const char* special_param(char c, char* numbuf) {
+    if (c == '?') {
+        sprintf(numbuf, "%d", last_status);
+        return numbuf;
+    }
+    if (c == '#') {
+        sprintf(numbuf, "%d", pos_count);
+        return numbuf;
+    }
+    if (c == '0') {
+        return arg0;
+    }
+    if (c >= '1' && c <= '9') {
+        return (c - '1' < pos_count) ? pos_args[c - '1'] : "";
+    }
+    return NULL;
+}
+
+// Value of the parameter referenced by the $ at p: a special parameter, $NAME or ${NAME}.
+// Shell variables shadow the environment. Sets *consumed to the length of the reference;
+// returns NULL when the $ does not start one and is taken literally.
+const char* param_value(const char* p, size_t* consumed, char* numbuf, VarTable* vars) {
+    const char* val = special_param(p[1], numbuf);
+    if (val != NULL) {
+        *consumed = 2;
+        return val;
+    }
+    const char* name = p + 1;
+    size_t len = name_length(name);
+    if (p[1] == '{') {
+        name = p + 2;
+        len = name_length(name);
+        if (len == 0 || name[len] != '}') return NULL;
+        *consumed = len + 3;
+    } else if (len > 0) {
+        *consumed = len + 1;
+    } else {
+        return NULL;
+    }
+    Var* var = find_var(name, len, vars);
+    if (var != NULL) return var->value;
+    char env_name[256];
+    if (len < sizeof(env_name)) {
+        memcpy(env_name, name, len);
+        env_name[len] = '\0';
+        val = getenv(env_name);
+    }
+    return val != NULL ? val : "";
+}
+
+// Expand the words of a simple command into an argv in the arena. A word that is exactly
+// $@ or $*, or "$@", becomes one word per positional parameter, and "$*" one word joining
+// them with spaces; any other word expands to one word, or to none when it is unquoted and
+// comes out empty. Expanded words are not split again. A command with nothing to expand
+// runs with its words as they are.
+char** expand_words(char** words, int nwords, Arena* arena, VarTable* vars) {
+    int special = 0;
+    for (int i = 0; i < nwords; i++) {
+        if (strpbrk(words[i], EXPAND_CHARS) != NULL) special++;
+    }
+    if (special == 0) return words;
+
+    // Worst case every such word is $@
+    char** argv = arena_alloc(arena, sizeof(char*) * ((size_t)nwords + (size_t)special * pos_count + 1));
+    int n = 0;
+    for (int i = 0; i < nwords; i++) {
+        char* word = words[i];
+        if (strcmp(word, "$@") == 0 || strcmp(word, "$*") == 0 || strcmp(word, "\"$@\"") == 0) {
+            for (int k = 0; k < pos_count; k++) argv[n++] = pos_args[k];
+        } else if (strcmp(word, "\"$*\"") == 0) {
+            StrBuf b;
+            sb_init(&b, arena, 64);
+            for (int k = 0; k < pos_count; k++) {
+                if (k > 0) sb_put(&b, " ", 1);
+                sb_put(&b, pos_args[k], strlen(pos_args[k]));
+            }
+            argv[n++] = b.data;
+        } else if ((word = expand_word(word, arena, vars)) != NULL) {
+            argv[n++] = word;
+        }
+    }
+    argv[n] = NULL;
+    return argv;
+}
+
+// Expand one word as typed: parameters, arithmetic and command substitutions outside
+// single quotes, then quote removal.
+// Returns the word itself when there is nothing to do, or NULL when it is unquoted and
+// expands to nothing, so it should be dropped.
+char* expand_word(char* word, Arena* arena, VarTable* vars) {
+    if (strpbrk(word, EXPAND_CHARS) == NULL) return word;
+    char numbuf[16];
+    int quoted = 0;
+    StrBuf b;
+    sb_init(&b, arena, strlen(word) + 32);
+    const char* p = word;
+    while (*p != '\0') {
+        if (*p == '\'') {
+            const char* end = strchr(p + 1, '\'');
+            if (end == NULL) end = p + strlen(p);
+            sb_put(&b, p + 1, end - p - 1);
+            p = *end != '\0' ? end + 1 : end;
+            quoted = 1;
+        } else if (*p == '"') {
+            // Inside double quotes a backslash only escapes $ ` " and itself
+            for (p++; *p != '\0' && *p != '"';) {
+                if (*p == '\\' && p[1] == '\n') {
+                    p += 2;
+                } else if (*p == '\\' && p[1] != '\0' && strchr("$`\"\\", p[1]) != NULL) {
+                    sb_put(&b, p + 1, 1);
+                    p += 2;
+                } else if (*p == '$') {
+                    p = expand_param(&b, p, numbuf, vars);
+                } else if (*p == '`') {
+                    p = expand_backquote(&b, p, 1);
+                } else {
+                    size_t len = strcspn(p + 1, "\"\\$`") + 1;
+                    sb_put(&b, p, len);
+                    p += len;
+                }
+            }
+            if (*p != '\0') p++;
+            quoted = 1;
+        } else if (*p == '\\' && p[1] == '\n') {
+            p += 2;  // Line continuation
+        } else if (*p == '\\') {
+            if (p[1] != '\0') p++;
+            sb_put(&b, p++, 1);
+            quoted = 1;
+        } else if (*p == '$') {
+            p = expand_param(&b, p, numbuf, vars);
+        } else if (*p == '`') {
+            p = expand_backquote(&b, p, 0);
+        } else {
+            size_t len = strcspn(p, EXPAND_CHARS);
+            sb_put(&b, p, len);
+            p += len;
+        }
+    }
+    if (b.len == 0 && !quoted) return NULL;
+    return b.data;
+}
+
+// Append the value of the parameter, $( ) or $(( )) at p, or a literal $ when none starts
+// there; returns where the reference ends. $@ and $* inside a longer word join the
+// positional parameters with spaces.
+const char* expand_param(StrBuf* b, const char* p, char* numbuf, VarTable* vars) {
+    size_t consumed;
+    const char* end;
+    if (p[1] == '(' && p[2] != '(' && (end = subst_end(p)) != NULL) {
+        command_subst(b, p + 2, end - p - 3);
+        return end;
+    }
+    if (p[1] == '(' && p[2] == '(' && (end = arith_end(p)) != NULL) {
+        long value;
+        char digits[24];
+        if (arith_eval(arena_strndup(b->arena, p + 3, end - p - 5), &value, vars) != 0) {
+            expansion_failed = 1;
+            return end;
+        }
+        sb_put(b, digits, snprintf(digits, sizeof(digits), "%ld", value));
+        return end;
+    }
+    if (p[1] == '@' || p[1] == '*') {
+        for (int k = 0; k < pos_count; k++) {
+            if (k > 0) sb_put(b, " ", 1);
+            sb_put(b, pos_args[k], strlen(pos_args[k]));
+        }
+        return p + 2;
+    }
+    const char* val = param_value(p, &consumed, numbuf, vars);
+    if (val == NULL) {
+        sb_put(b, p, 1);
+        return p + 1;
+    }
+    sb_put(b, val, strlen(val));
+    return p + consumed;
+}
+
+// Append the output of the `` `command` `` at p and return where it ends. Inside the
+// backquotes a backslash only escapes $ ` \ and, within double quotes, ".
+const char* expand_backquote(StrBuf* b, const char* p, int dquoted) {
+    const char* close = subst_end(p);
+    close = close != NULL ? close - 1 : p + strlen(p);  // The lexer never lets one stay open
+    StrBuf cmd;
+    sb_init(&cmd, b->arena, close - p);
+    for (p++; p < close; p++) {
+        if (*p == '\\' && (strchr("$`\\", p[1]) != NULL || (dquoted && p[1] == '"'))) p++;
+        sb_put(&cmd, p, 1);
+    }
+    command_subst(b, cmd.data, cmd.len);
+    return *close != '\0' ? close + 1 : close;
+}
+
+// Run the command of a substitution and append its output, without trailing newlines.
+// $? becomes its status. Its trees come from the parse cache, so a substitution in a loop
+// is parsed once. A lone builtin that only writes output, such as echo, printf or pwd,
+// runs in the shell with its output collected straight into b: no fork, no pipe. A plain
+// external command is spawned onto a pipe; anything else runs in a forked copy of the
+// shell. Output is read into b as it comes, its free space doubling as it fills.
+void command_subst(StrBuf* b, const char* cmd, size_t len) {
+    Shell* sh = current_shell;
+    int failed = expansion_failed;
+    int status = 0;
+    size_t start = b->len;
+    Node* tree = parse_line(arena_strndup(&cmd_arena, cmd, len), sh, &status);
+    if (tree == NULL) {
+        if (status == PARSE_MORE) fprintf(stderr, "syntax error: unexpected end of file\n");
+        expansion_failed |= status != 0;
+        subst_status = last_status = status != 0 ? 2 : 0;
+        return;
+    }
+
+    const Builtin* builtin = NULL;
+    int simple = tree->type == NODE_CMD && tree->redirs == NULL && tree->n > 0 && !assignments_only(tree->words) &&
+                 strpbrk(tree->words[0], EXPAND_CHARS) == NULL && strcmp(tree->words[0], "pipesize") != 0;
+    if (simple) {
+        builtin = find_builtin(tree->words[0]);
+        simple = builtin == NULL || (builtin->flags & (BUILTIN_SUBSHELL | BUILTIN_STATE | BUILTIN_STDIN)) == BUILTIN_SUBSHELL;
+    }
+    char** argv = NULL;
+    if (simple) {
+        expansion_failed = 0;
+        argv = tree->flags & NODE_PLAIN ? tree->words : expand_words(tree->words, tree->n, &cmd_arena, sh->vars);
+        if (expansion_failed) status = 1;
+    }
+
+    if (simple && builtin != NULL) {
+        if (status == 0) {
+            Out out;
+            out_init(&out, -1);
+            out.sink = b;
+            status = builtin->run(argv, sh, &out);
+            out_flush(&out);
+        }
+    } else if (status == 0) {
+        int fds[2];
+        pid_t pid;
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("Pipe failed");
+            exit(1);
+        }
+        fflush(stdout);
+        if (simple) {
+            pid = spawn_mode == SPAWN_FORK ? fork_stage(argv, -1, fds[1]) : spawn_stage(argv, -1, fds[1]);
+        } else if ((pid = fork()) == 0) {  // Child process, a shell like a subshell's
+            events_reset();
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            int child_status = exec_node(tree, sh, 1);
+            fflush(stdout);
+            _exit(child_status);
+        } else if (pid < 0) {
+            perror("Fork failed");
+        }
+        close(fds[1]);
+        Job* job = pid > 0 ? job_create(&pid, 1, NULL, 0) : NULL;
+        sb_read(b, fds[0]);
+        close(fds[0]);
+        if (job != NULL) {
+            status = job_wait(job);
+            job_free(job);
+        } else {
+            status = 127;
+        }
+    }
+    while (b->len > start && b->data[b->len - 1] == '\n') b->len--;
+    b->data[b->len] = '\0';
+    expansion_failed = failed;
+    subst_status = last_status = status;
+}
+
+// Evaluate expr into *result; reports an error and returns 1 if it has one
+int arith_eval(const char* expr, long* result, VarTable* vars) {
+    Arith a = { expr, NULL, 0, 0, vars };
+    *result = arith_run(&a);
+    if (a.error != NULL) {
+        fprintf(stderr, "%s: %s\n", expr, a.error);
+        return 1;
+    }
+    return 0;
+}
+
+// A whole expression: the comma list must use up the text
+long arith_run(Arith* a) {
+    long value = arith_comma(a);
+    arith_space(a);
+    if (*a->p != '\0') arith_fail(a, "syntax error in expression");
+    return value;
+}
+
+void arith_fail(Arith* a, const char* error) {
+    if (a->error == NULL) a->error = error;
+    a->p += strlen(a->p);
+}
+
+void arith_space(Arith* a) {
+    while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n') a->p++;
+}
+
+// A plain number with optional sign and surrounding blanks, as a variable may hold;
+// 0x is hex and a leading 0 octal
+int arith_number(const char* str, long* num) {
+    char* end;
+    while (*str == ' ' || *str == '\t' || *str == '\n') str++;
+    if (!((*str >= '0' && *str <= '9') || ((*str == '-' || *str == '+') && str[1] >= '0' && str[1] <= '9'))) return 0;
+    long n = strtol(str, &end, 0);
+    while (*end == ' ' || *end == '\t' || *end == '\n') end++;
+    if (*end != '\0') return 0;
+    *num = n;
+    return 1;
+}
+
+long arith_comma(Arith* a) {
+    long value = arith_assign(a);
+    while (arith_space(a), *a->p == ',') {
+        a->p++;
+        value = arith_assign(a);
+    }
+    return value;
+}
+
+// NAME op= expr, right to left, or a conditional expression
+long arith_assign(Arith* a) {
+    arith_space(a);
+    const char* name = a->p;
+    size_t len = name_length(name);
+    if (len > 0) {
+        const char* q = name + len;
+        while (*q == ' ' || *q == '\t' || *q == '\n') q++;
+        // = += -= *= /= %= &= ^= |= <<= >>=, but not ==
+        size_t op_len = q[0] == '=' ? (q[1] != '=')
+                      : strchr("+-*/%&^|", q[0]) != NULL && q[1] == '=' ? 2
+                      : (q[0] == '<' || q[0] == '>') && q[1] == q[0] && q[2] == '=' ? 3 : 0;
+        if (op_len > 0) {
+            a->p = q + op_len;
+            long value = arith_assign(a);
+            if (op_len > 1) value = arith_apply(a, q, op_len - 1, arith_var(a, name, len), value);
+            arith_store(a, name, len, value);
+            return value;
+        }
+    }
+    return arith_ternary(a);
+}
+
+long arith_ternary(Arith* a) {
+    long cond = arith_binary(a, 1);
+    arith_space(a);
+    if (*a->p != '?') return cond;
+    a->p++;
+    int skip = a->skip;
+    a->skip = skip || !cond;
+    long yes = arith_comma(a);
+    arith_space(a);
+    if (*a->p != ':') {
+        arith_fail(a, "`:' expected for conditional expression");
+        return 0;
+    }
+    a->p++;
+    a->skip = skip || cond;
+    long no = arith_assign(a);
+    a->skip = skip;
+    return cond ? yes : no;
+}
+
+// Precedence of the binary operator at p, from || (1) to ** (11), and its length;
+// 0 when there is none there, or it is the start of an assignment
+int arith_binop(const char* p, int* len) {
+    int twice = p[1] == p[0];
+    *len = 1;
+    switch (p[0]) {
+    case '|':
+    case '&':
+        if (twice) {
+            *len = 2;
+            return p[0] == '|' ? 1 : 2;
+        }
+        if (p[1] == '=') return 0;
+        return p[0] == '|' ? 3 : 5;
+    case '^':
+        return p[1] == '=' ? 0 : 4;
+    case '=':
+    case '!':
+        *len = 2;
+        return p[1] == '=' ? 6 : 0;
+    case '<':
+    case '>':
+        if (twice) {
+            *len = 2;
+            return p[2] == '=' ? 0 : 8;
+        }
+        *len = 1 + (p[1] == '=');
+        return 7;
+    case '+':
+    case '-':
+        return p[1] == '=' ? 0 : 9;
+    case '*':
+        if (twice) {
+            *len = 2;
+            return 11;
+        }
+        return p[1] == '=' ? 0 : 10;
+    case '/':
+    case '%':
+        return p[1] == '=' ? 0 : 10;
+    }
+    return 0;
+}
+
+// Binary operators binding at least as tightly as min_prec, left to right but for **
+long arith_binary(Arith* a, int min_prec) {
+    long left = arith_unary(a);
+    for (;;) {
+        int len;
+        arith_space(a);
+        int prec = arith_binop(a->p, &len);
+        if (prec == 0 || prec < min_prec) return left;
+        const char* op = a->p;
+        a->p += len;
+        if (prec <= 2) {
+            // && and || leave their right side unevaluated once the outcome is known
+            int skip = a->skip;
+            a->skip = skip || (prec == 1 ? left != 0 : left == 0);
+            long right = arith_binary(a, prec + 1);
+            a->skip = skip;
+            left = prec == 1 ? (left || right) : (left && right);
+        } else {
+            left = arith_apply(a, op, len, left, arith_binary(a, prec == 11 ? prec : prec + 1));
+        }
+    }
+}
+
+// One binary operator. Overflow wraps around rather than being undefined.
+long arith_apply(Arith* a, const char* op, int len, long l, long r) {
+    switch (op[0]) {
+    case '+': return (long)((unsigned long)l + (unsigned long)r);
+    case '-': return (long)((unsigned long)l - (unsigned long)r);
+    case '*':
+        if (len == 1) return (long)((unsigned long)l * (unsigned long)r);
+        if (r < 0) {
+            if (!a->skip) arith_fail(a, "exponent less than 0");
+            return 0;
+        }
+        unsigned long power = 1, base = l;
+        for (; r > 0; r >>= 1, base *= base) {
+            if (r & 1) power *= base;
+        }
+        return (long)power;
+    case '/':
+    case '%':
+        if (r == 0) {
+            if (!a->skip) arith_fail(a, "division by 0");
+            return 0;
+        }
+        if (r == -1) return op[0] == '/' ? (long)(0 - (unsigned long)l) : 0;
+        return op[0] == '/' ? l / r : l % r;
+    case '<':
+        if (len == 2 && op[1] == '<') return (long)((unsigned long)l << (r & 63));
+        return len == 2 ? l <= r : l < r;
+    case '>':
+        if (len == 2 && op[1] == '>') return l >> (r & 63);
+        return len == 2 ? l >= r : l > r;
+    case '=': return l == r;
+    case '!': return l != r;
+    case '&': return l & r;
+    case '^': return l ^ r;
+    case '|': return l | r;
+    }
+    return 0;
+}
+
+// Prefix operators, ++NAME and --NAME, then a primary with its postfix ++ or --
+long arith_unary(Arith* a) {
+    arith_space(a);
+    char c = *a->p;
+    if ((c == '+' || c == '-') && a->p[1] == c) {
+        a->p += 2;
+        arith_space(a);
+        size_t len = name_length(a->p);
+        if (len == 0) {
+            arith_fail(a, "++ and -- need a variable");
+            return 0;
+        }
+        const char* name = a->p;
+        a->p += len;
+        long value = (long)((unsigned long)arith_var(a, name, len) + (c == '+' ? 1UL : -1UL));
+        arith_store(a, name, len, value);
+        return value;
+    }
+    if (c == '+' || c == '-' || c == '!' || c == '~') {
+        a->p++;
+        long value = arith_unary(a);
+        switch (c) {
+        case '-': return (long)(0 - (unsigned long)value);
+        case '!': return !value;
+        case '~': return ~value;
+        }
+        return value;
+    }
+    return arith_primary(a);
+}
+
+// A number, a variable, a $ expansion or a parenthesized expression
+long arith_primary(Arith* a) {
+    const char* p = a->p;
+    long value;
+    if (*p == '(') {
+        a->p++;
+        value = arith_comma(a);
+        arith_space(a);
+        if (*a->p != ')') {
+            arith_fail(a, "missing `)'");
+            return 0;
+        }
+        a->p++;
+        return value;
+    }
+    if (*p >= '0' && *p <= '9') {
+        char* end;
+        value = strtol(p, &end, 0);
+        if (name_length(end) > 0 || (*end >= '0' && *end <= '9')) {
+            arith_fail(a, "invalid number");
+            return 0;
+        }
+        a->p = end;
+        return value;
+    }
+    if (*p == '$') {
+        // Expanded first, so $( ) only runs on the side that is taken
+        const char* end = p[1] == '(' ? subst_end(p) : NULL;
+        if (end != NULL && a->skip) {
+            a->p = end;
+            return 0;
+        }
+        char numbuf[16];
+        StrBuf b;
+        sb_init(&b, &cmd_arena, 32);
+        end = expand_param(&b, p, numbuf, a->vars);
+        if (end == p + 1) {
+            arith_fail(a, "syntax error: operand expected");
+            return 0;
+        }
+        a->p = end;
+        return arith_text(a, b.data);
+    }
+    size_t len = name_length(p);
+    if (len == 0) {
+        arith_fail(a, "syntax error: operand expected");
+        return 0;
+    }
+    a->p += len;
+    value = arith_var(a, p, len);
+    // Postfix ++ and -- yield the old value
+    if ((a->p[0] == '+' || a->p[0] == '-') && a->p[1] == a->p[0]) {
+        arith_store(a, p, len, (long)((unsigned long)value + (a->p[0] == '+' ? 1UL : -1UL)));
+        a->p += 2;
+    }
+    return value;
+}
+
+// A variable's value: its integer, or its text taken as an expression; 0 when it is
+// unset or empty. The environment stands in for variables the shell has not set.
+long arith_var(Arith* a, const char* name, size_t len) {
+    Var* var = find_var(name, len, a->vars);
+    long value;
+    if (var != NULL) {
+        return var_number(var, &value) ? value : arith_text(a, var->value);
+    }
+    char env_name[256];
+    const char* env = NULL;
+    if (len < sizeof(env_name)) {
+        memcpy(env_name, name, len);
+        env_name[len] = '\0';
+        env = getenv(env_name);
+    }
+    return env != NULL ? arith_text(a, env) : 0;
+}
+
+long arith_text(Arith* a, const char* text) {
+    long value;
+    if (arith_number(text, &value)) return value;
+    if (text[strspn(text, " \t\n")] == '\0') return 0;
+    if (a->depth >= ARITH_DEPTH_MAX) {
+        arith_fail(a, "expression recursion level exceeded");
+        return 0;
+    }
+    // A copy, since an assignment inside may replace the variable's own text
+    Arith inner = { arena_strndup(&cmd_arena, text, strlen(text)), NULL, a->skip, a->depth + 1, a->vars };
+    value = arith_run(&inner);
+    if (inner.error != NULL) arith_fail(a, inner.error);
+    return value;
+}
+
+void arith_store(Arith* a, const char* name, size_t len, long value) {
+    if (a->skip || a->error != NULL) return;
+    set_var_num(name, len, value, a->vars);
+}
+
+// The expression of a word that is one $(( )) and nothing else, copied into the command
+// arena; NULL for any other word
+char* arith_word(const char* word) {
+    const char* end;
+    if (word[0] != '$' || word[1] != '(' || word[2] != '(' || (end = arith_end(word)) == NULL || *end != '\0') {
+        return NULL;
+    }
+    return arena_strndup(&cmd_arena, word + 3, end - word - 5);
+}
+
+// End of the $(( )) starting at p, just past its closing parentheses; NULL when the
+// text ends first
+const char* arith_end(const char* p) {
+    int depth = 0;
+    for (p++; *p != '\0'; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+// Return the next line without its newline, or NULL at end of input.
+// Input is read ahead in large chunks with read(2) and lines are found with memchr;
+// as with the stdio reader this replaces, commands that read the shell's own stdin
+// only see what has not been buffered yet.
+char* read_line(LineReader* reader) {
+    size_t scanned = reader->start;
+    while (1) {
+        char* nl = memchr(reader->buf + scanned, '\n', reader->end - scanned);
+        if (nl != NULL) {
+            char* line = reader->buf + reader->start;
+            *nl = '\0';
+            reader->start = nl - reader->buf + 1;
+            return line;
+        }
+        scanned = reader->end;
+        if (reader->eof) {
+            // Last line without a trailing newline
+            if (reader->start == reader->end) return NULL;
+            char* line = reader->buf + reader->start;
+            reader->buf[reader->end] = '\0';
+            reader->start = reader->end;
+            return line;
+        }
+        // Make room: slide the partial line to the front, then grow if still short of a chunk
+        if (reader->start > 0) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            scanned -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->cap - reader->end < READ_CHUNK / 2) {
+            reader->buf = xrealloc(reader->buf, reader->cap * 2 + 1);
+            reader->cap *= 2;
+        }
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read failed");
+            n = 0;
+        }
+        if (n == 0) {
+            reader->eof = 1;
+        }
+        reader->end += n;
+    }
+}
+
+// Counted allocation helpers; like the rest of the shell they give up on out-of-memory
+void* xmalloc(size_t size) {
+    void* p = malloc(size);
+    if (p == NULL) {
         perror("malloc failed");
         exit(1);
     }
-    while((c = getc(fp)) != EOF) {
-        if(c == '\n') break;
-        cmdline[pos++] = c;
+    heap_calls++;
+    return p;
+}
+
+void* xcalloc(size_t count, size_t size) {
+    void* p = calloc(count, size);
+    if (p == NULL) {
+        perror("calloc failed");
+        exit(1);
     }
-    if(c == EOF && pos == 0) {
-        free(cmdline);
-        return NULL;
+    heap_calls++;
+    return p;
+}
+
+void* xrealloc(void* ptr, size_t size) {
+    void* p = realloc(ptr, size);
+    if (p == NULL) {
+        perror("realloc failed");
+        exit(1);
+    }
+    heap_calls++;
+    return p;
+}
+
+char* xstrdup(const char* str) {
+    char* p = strdup(str);
+    if (p == NULL) {
+        perror("strdup failed");
+        exit(1);
+    }
+    heap_calls++;
+    return p;
+}
+
+// Bump-allocate from the arena; blocks are only requested from the heap when every
+// block kept from earlier command lines is too small
+void* arena_alloc(Arena* arena, size_t size) {
+    size = ARENA_ALIGN(size);
+    if (arena->cur == NULL || arena->used + size > arena->cur->size) {
+        ArenaBlock* next = arena->cur ? arena->cur->next : arena->first;
+        if (next == NULL || next->size < size) {
+            size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            ArenaBlock* block = xmalloc(sizeof(ArenaBlock) + block_size);
+            block->size = block_size;
+            block->next = next;
+            if (arena->cur) {
+                arena->cur->next = block;
+            } else {
+                arena->first = block;
+            }
+            next = block;
+        }
+        arena->cur = next;
+        arena->used = 0;
+    }
+    void* p = arena->cur->data + arena->used;
+    arena->used += size;
+    arena->total += size;
+    return p;
+}
+
+char* arena_strndup(Arena* arena, const char* str, size_t len) {
+    char* p = arena_alloc(arena, len + 1);
+    memcpy(p, str, len);
+    p[len] = '\0';
+    return p;
+}
+
+void sb_init(StrBuf* b, Arena* arena, size_t cap) {
+    b->data = arena_alloc(arena, cap);
+    b->data[0] = '\0';
+    b->len = 0;
+    b->cap = cap;
+    b->arena = arena;
+}
+
+// Make room for len more bytes and the NUL
+void sb_reserve(StrBuf* b, size_t len) {
+    if (b->len + len + 1 > b->cap) {
+        size_t cap = b->cap * 2;
+        while (cap < b->len + len + 1) cap *= 2;
+        char* data = arena_alloc(b->arena, cap);
+        memcpy(data, b->data, b->len);
+        b->data = data;
+        b->cap = cap;
+    }
+}
+
+// Append everything read from fd up to end of file, straight into b's free space, which
+// grows with what b holds so large outputs take few reads
+void sb_read(StrBuf* b, int fd) {
+    for (;;) {
+        sb_reserve(b, b->len + 4096);
+        ssize_t n = read(fd, b->data + b->len, b->cap - b->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) perror("read failed");
+        if (n <= 0) break;
+        b->len += n;
+    }
+    b->data[b->len] = '\0';
+}
+
+void sb_put(StrBuf* b, const char* str, size_t len) {
+    sb_reserve(b, len);
+    memcpy(b->data + b->len, str, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+}
+
+// Release everything allocated since the last reset; the blocks stay for reuse
+void arena_reset(Arena* arena) {
+    if (arena->total > arena->peak) arena->peak = arena->total;
+    arena->cur = arena->first;
+    arena->used = 0;
+    arena->total = 0;
+}
+
+ArenaMark arena_mark(Arena* arena) {
+    return (ArenaMark){ arena->cur, arena->used, arena->total };
+}
+
+// Release everything allocated since mark; the blocks stay for reuse
+void arena_rewind(Arena* arena, ArenaMark mark) {
+    if (arena->total > arena->peak) arena->peak = arena->total;
+    arena->cur = mark.cur;
+    arena->used = mark.used;
+    arena->total = mark.total;
+}
+
+// Start an empty arena with one block of exactly size bytes, for contents of known size
+void arena_init(Arena* arena, size_t size) {
+    ArenaBlock* block = xmalloc(sizeof(ArenaBlock) + size);
+    block->size = size;
+    block->next = NULL;
+    *arena = (Arena){ block, block, 0, 0, 0 };
+}
+
+// Give an arena's blocks back to the heap when its owner goes away
+void arena_free(Arena* arena) {
+    ArenaBlock* block = arena->first;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
     }
-    cmdline[pos] = '\0';
-    return cmdline;
-}
\ No newline at end of file
+    *arena = (Arena){ NULL, NULL, 0, 0, 0 };
+}
+
+// stats: internal counters for checking the shell's own overhead
+void print_stats(Out* out) {
+    int blocks = 0;
+    size_t reserved = 0;
+    for (ArenaBlock* b = cmd_arena.first; b != NULL; b = b->next) {
+        blocks++;
+        reserved += b->size;
+    }
+    out_printf(out, "heap calls: %ld\n", heap_calls);
+    out_printf(out, "arena: %d blocks, %zu bytes reserved, %zu bytes peak per command\n", blocks, reserved, cmd_arena.peak);
+    out_printf(out, "hash: %ld hits, %ld misses\n", cmd_hash_hits, cmd_hash_misses);
+    long lookups = parse_cache_hits + parse_cache_misses;
+    out_printf(out, "parse cache: %ld hits, %ld misses (%.1f%% hit rate), %d entries, %zu bytes\n", parse_cache_hits,
+               parse_cache_misses, lookups > 0 ? 100.0 * parse_cache_hits / lookups : 0.0, parse_cache_count, parse_cache_bytes);
+    out_printf(out, "env rebuilds: %ld\n", env_rebuilds);
+    out_printf(out, "cat stages elided: %ld\n", cat_elided);
+    out_printf(out, "jobs: %d background, %d queued, %d processes running\n", job_ids.count, queued_jobs, job_pids.count);
+}
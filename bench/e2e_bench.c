@@ -0,0 +1,230 @@
+// End-to-end benchmark: commands per second for generated scripts.
+//
+// Build: make build/e2e_bench
+// Usage: ./build/e2e_bench lines shell [shell...]
+//
+// Every shell runs the same scripts as `shell script`, so the shell under test can be
+// compared with a baseline (/bin/sh or an older build). Prints one JSON object per
+// line; "ok" is false when the script's output does not match what it should produce.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+static char dir[] = "/tmp/e2e_benchXXXXXX";
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Write a script of `lines` commands, returning how many output lines it must print
+typedef long (*generator)(FILE* fp, long lines, int arg);
+
+static long gen_trivial(FILE* fp, long lines, int arg) {
+    (void)arg;
+    for (long i = 0; i < lines; i++) {
+        fprintf(fp, "true\n");
+    }
+    return 0;
+}
+
+static long gen_pipeline(FILE* fp, long lines, int stages) {
+    for (long i = 0; i < lines; i++) {
+        fprintf(fp, "echo x");
+        for (int k = 1; k < stages; k++) {
+            fprintf(fp, " | cat");
+        }
+        fprintf(fp, "\n");
+    }
+    return lines;
+}
+
+// The bread and butter of generated scripts: echo, printf, test and pwd
+static long gen_script(FILE* fp, long lines, int arg) {
+    (void)arg;
+    long out = 0;
+    for (long i = 0; i < lines; i++) {
+        switch (i % 5) {
+        case 0: fprintf(fp, "echo step %ld\n", i); out++; break;
+        case 1: fprintf(fp, "test -d %s\n", dir); break;
+        case 2: fprintf(fp, "[ %ld -lt %ld ]\n", i, lines); break;
+        case 3: fprintf(fp, "printf %%s:%%d: step %ld\n", i); break;  // Ends the next echo's line
+        case 4: fprintf(fp, "pwd > %s/a\n", dir); break;
+        }
+    }
+    return out;
+}
+
+// Like gen_pipeline, but cat -u stages are real processes the shell cannot elide
+static long gen_long_pipeline(FILE* fp, long lines, int stages) {
+    for (long i = 0; i < lines; i++) {
+        fprintf(fp, "echo x");
+        for (int k = 1; k < stages; k++) {
+            fprintf(fp, " | cat -u");
+        }
+        fprintf(fp, "\n");
+    }
+    return lines;
+}
+
+// One echo with `words` arguments per line
+static long gen_args(FILE* fp, long lines, int words) {
+    for (long i = 0; i < lines; i++) {
+        fprintf(fp, "echo");
+        for (int k = 0; k < words; k++) {
+            fprintf(fp, " w%d", k);
+        }
+        fprintf(fp, "\n");
+    }
+    return lines;
+}
+
+static long gen_redirect(FILE* fp, long lines, int arg) {
+    (void)arg;
+    long out = 0;
+    for (long i = 0; i < lines; i++) {
+        switch (i % 3) {
+        case 0: fprintf(fp, "echo x > %s/a\n", dir); break;
+        case 1: fprintf(fp, "cat < %s/a > %s/b\n", dir, dir); break;
+        case 2: fprintf(fp, "cat < %s/b\n", dir); out++; break;
+        }
+    }
+    return out;
+}
+
+// One script, a loop of `lines` passes over builtins and variables only: `inner` passes of
+// an inner loop per outer one, printing one line each outer pass
+static long gen_loop(FILE* fp, long lines, int inner) {
+    long outer = lines / inner;
+    fprintf(fp, "for a in");
+    for (long i = 0; i < outer; i++) fprintf(fp, " %ld", i);
+    fprintf(fp, "\ndo\n  for b in");
+    for (int k = 0; k < inner; k++) fprintf(fp, " %d", k);
+    fprintf(fp, "\n  do\n    x=$a.$b\n    if [ $b = 0 ]; then echo $x; fi\n  done\ndone\n");
+    return outer;
+}
+
+// A counting loop of `lines` passes done with $(( )), printing every `every`th count
+static long gen_arith(FILE* fp, long lines, int every) {
+    fprintf(fp, "i=0\nwhile [ $i -lt %ld ]\ndo\n  i=$((i + 1))\n", lines);
+    fprintf(fp, "  if [ $((i %% %d)) -eq 0 ]; then echo $i; fi\ndone\n", every);
+    return lines / every;
+}
+
+// One loop of `lines` passes, each taking the output of two builtins with $( ), printing
+// every `every`th result
+static long gen_subst_loop(FILE* fp, long lines, int every) {
+    fprintf(fp, "i=0\nwhile [ $i -lt %ld ]\ndo\n  i=$((i + 1))\n  x=$(echo v$i)\n", lines);
+    fprintf(fp, "  y=\"$(printf '%%s' \"$x\")\"\n  if [ $((i %% %d)) -eq 0 ]; then echo $y; fi\ndone\n", every);
+    return lines / every;
+}
+
+// One echo per line of what a substitution prints: an external command, or a pipeline
+// of `stages` stages
+static long gen_subst(FILE* fp, long lines, int stages) {
+    for (long i = 0; i < lines; i++) {
+        if (stages == 1) {
+            fprintf(fp, "echo $(basename /a/b%ld)\n", i);
+        } else {
+            fprintf(fp, "echo $(echo %ld", i);
+            for (int k = 1; k < stages; k++) fprintf(fp, " | cat -u");
+            fprintf(fp, ")\n");
+        }
+    }
+    return lines;
+}
+
+static long count_lines(const char* path) {
+    FILE* fp = fopen(path, "r");
+    long n = 0;
+    int c;
+    if (fp == NULL) return -1;
+    while ((c = getc(fp)) != EOF) {
+        if (c == '\n') n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+static void run(const char* shell, const char* name, generator gen, long lines, int arg) {
+    char script[256], output[256];
+    snprintf(script, sizeof(script), "%s/%s.sh", dir, name);
+    snprintf(output, sizeof(output), "%s/%s.out", dir, name);
+
+    FILE* fp = fopen(script, "w");
+    if (fp == NULL) {
+        perror(script);
+        exit(1);
+    }
+    long expected = gen(fp, lines, arg);
+    fclose(fp);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    char* argv[] = { (char*)shell, script, NULL };
+    pid_t pid;
+    int status = 0;
+
+    double start = now_s();
+    if (posix_spawn(&pid, shell, &actions, NULL, argv, environ) != 0) {
+        perror(shell);
+        exit(1);
+    }
+    waitpid(pid, &status, 0);
+    double elapsed = now_s() - start;
+    posix_spawn_file_actions_destroy(&actions);
+
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && count_lines(output) == expected;
+    printf("{\"shell\": \"%s\", \"bench\": \"%s\", \"commands\": %ld, \"seconds\": %.4f, "
+           "\"cmds_per_sec\": %.1f, \"ok\": %s}\n",
+           shell, name, lines, elapsed, lines / elapsed, ok ? "true" : "false");
+    fflush(stdout);
+    unlink(script);
+    unlink(output);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s lines shell [shell...]\n", argv[0]);
+        return 1;
+    }
+    long lines = atol(argv[1]);
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        run(argv[i], "trivial", gen_trivial, lines, 0);
+        run(argv[i], "script", gen_script, lines, 0);
+        run(argv[i], "pipeline_2", gen_pipeline, lines, 2);
+        run(argv[i], "pipeline_4", gen_pipeline, lines, 4);
+        run(argv[i], "pipeline_8", gen_pipeline, lines, 8);
+        run(argv[i], "pipeline_64", gen_long_pipeline, lines / 16 > 0 ? lines / 16 : 1, 64);
+        run(argv[i], "args_1000", gen_args, lines, 1000);
+        run(argv[i], "redirect", gen_redirect, lines, 0);
+        run(argv[i], "loop", gen_loop, lines * 500, 1000);
+        run(argv[i], "arith", gen_arith, lines * 500, 1000);
+        run(argv[i], "subst_builtin", gen_subst_loop, lines * 5, 100);
+        run(argv[i], "subst_exec", gen_subst, lines, 1);
+        run(argv[i], "subst_pipeline", gen_subst, lines, 2);
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/a", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/b", dir);
+    unlink(path);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,63 @@
+// Reverse history search latency at growing history sizes.
+//
+// Build: make build/histsearch_bench
+// Usage: ./build/histsearch_bench [queries]
+//
+// Fills a history with synthetic commands, then times history_search() for a few query
+// shapes. Prints one JSON object per line: {"bench": name, "entries": n, "us_per_query": t}.
+#define _GNU_SOURCE  // Before any system header, as in Version-6.c
+#include <time.h>
+
+#define main shell_main
+#include "../Version-6.c"
+#undef main
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Keeps results alive so the compiler cannot drop the calls
+static volatile long sink;
+
+static const char* verbs[] = { "git status", "make -j8", "ls -l", "grep -rn", "vim", "cd", "ssh host", "cat" };
+
+static void fill(History* history, long entries) {
+    char line[128];
+    for (long i = 0; i < entries; i++) {
+        // A few hot commands repeated often, many one-off ones
+        if (i % 4 == 0) {
+            snprintf(line, sizeof(line), "%s", verbs[i % 8]);
+        } else {
+            snprintf(line, sizeof(line), "%s src/file%ld.c --opt=%ld", verbs[i % 8], i * 7919 % 100003, i);
+        }
+        add_to_history(line, history);
+    }
+}
+
+static void bench_queries(long entries, long queries) {
+    const char* names[] = { "short", "common", "rare", "absent" };
+    const char* texts[] = { "gi", "make", "file4242.c", "zzzq" };
+    long results[SEARCH_RESULTS];
+    History history;
+
+    history_init(&history, entries);
+    fill(&history, entries);
+    for (int q = 0; q < 4; q++) {
+        double start = now_ns();
+        for (long i = 0; i < queries; i++) {
+            sink += history_search(&history, texts[q], results, SEARCH_RESULTS);
+        }
+        printf("{\"bench\": \"search_%s\", \"entries\": %ld, \"us_per_query\": %.2f}\n",
+               names[q], entries, (now_ns() - start) / queries / 1000);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    long queries = argc > 1 ? atol(argv[1]) : 200;
+    bench_queries(10000, queries);
+    bench_queries(100000, queries);
+    bench_queries(1000000, queries);
+    return 0;
+}
@@ -0,0 +1,127 @@
+// Microbenchmarks for the shell's per-command hot paths.
+//
+// Build: make build/micro_bench
+// Usage: ./build/micro_bench [iterations]
+//
+// Prints one JSON object per line: {"bench": name, "ops": n, "ns_per_op": t}.
+#define _GNU_SOURCE  // Before any system header, as in Version-6.c
+#include <time.h>
+
+#define main shell_main
+#include "../Version-6.c"
+#undef main
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name, long ops, double start) {
+    printf("{\"bench\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f}\n", name, ops, (now_ns() - start) / ops);
+}
+
+// Keeps results alive so the compiler cannot drop the calls
+static volatile long sink;
+
+static void bench_parse(long iters) {
+    Alias aliases[MAX_ALIASES];
+    int alias_count = 0;
+    Shell sh = { NULL, aliases, &alias_count, NULL };
+    int status = 0;
+
+    double start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        Node* tree = parse_tree("ls -l /usr/lib | grep so > out", &sh, &status);
+        sink += tree->n;
+        arena_reset(&cmd_arena);
+    }
+    report("parse_pipeline", iters, start);
+
+    start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        Node* tree = parse_tree("cd /tmp && (make -j4 'all' || echo \"failed: $?\") > log; true &", &sh, &status);
+        sink += tree->n;
+        arena_reset(&cmd_arena);
+    }
+    report("parse_list", iters, start);
+
+    // The same line again, as a history replay or a repeated script line is
+    start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        Node* tree = parse_line("cd /tmp && (make -j4 'all' || echo \"failed: $?\") > log; true &", &sh, &status);
+        sink += tree->n;
+        arena_reset(&cmd_arena);
+    }
+    report("parse_list_cached", iters, start);
+}
+
+static void bench_get_alias(long iters) {
+    Alias aliases[MAX_ALIASES];
+    int alias_count = 0;
+    char name[ARGLEN];
+
+    for (int i = 0; i < MAX_ALIASES; i++) {
+        snprintf(name, sizeof(name), "alias%d", i);
+        set_alias(name, "ls -l", aliases, &alias_count);
+    }
+    double start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        sink += get_alias("alias9", aliases, alias_count) != NULL;
+    }
+    report("get_alias_hit", iters, start);
+
+    start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        sink += get_alias("ls", aliases, alias_count) != NULL;
+    }
+    report("get_alias_miss", iters, start);
+}
+
+static void bench_get_var(long iters) {
+    VarTable vars = { NULL, 0, 0 };
+    char assignment[64];
+
+    for (int i = 0; i < 5000; i++) {
+        snprintf(assignment, sizeof(assignment), "VAR%d=value%d", i, i);
+        set_var(assignment, 0, &vars);
+    }
+    double start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        sink += get_var("VAR4999", &vars) != NULL;
+    }
+    report("get_var", iters, start);
+}
+
+static void bench_add_to_history(long iters) {
+    History history;
+    history_init(&history, 100000);
+
+    double start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        add_to_history("ls -l /usr/lib | grep so > out", &history);
+    }
+    report("add_to_history", iters, start);
+}
+
+static void bench_builtin_dispatch(long iters) {
+    char* external[] = { "ls", "-l", NULL };
+
+    // An external command pays for one builtin lookup before it is launched
+    double start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        sink += find_builtin(external[0]) != NULL;
+    }
+    report("builtin_dispatch_miss", iters, start);
+}
+
+int main(int argc, char* argv[]) {
+    long iters = argc > 1 ? atol(argv[1]) : 2000000;
+
+    bench_parse(iters);
+    bench_get_alias(iters);
+    bench_get_var(iters);
+    bench_add_to_history(iters);
+    bench_builtin_dispatch(iters);
+    return 0;
+}
@@ -0,0 +1,145 @@
+// Pipeline throughput benchmark: MB/s pushed through cat/tee pipelines.
+//
+// Build: make build/pipe_bench
+// Usage: ./build/pipe_bench megabytes shell [shell...]
+//
+// Writes a file of random bytes, then runs each pipeline as `shell -c pipeline` and
+// times it. Prints one JSON object per line; "ok" is false when the bytes that come out
+// of the pipeline (counted by wc -c) or the copies tee wrote do not match the input size.
+// copy_4 pushes the input, given as the shell's stdin, through three tee stages into wc.
+// The first shell also runs it at several pipe capacities using its `pipesize SIZE`
+// prefix; the other shells run it at their default capacity.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+static char dir[] = "/tmp/pipe_benchXXXXXX";
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// Run `shell -c cmdline` with stdout in a file and stdin from `input` (unless NULL);
+// return seconds, storing what wc -c printed
+static double run_pipeline(const char* shell, const char* cmdline, const char* input, long* counted) {
+    char output[256];
+    snprintf(output, sizeof(output), "%s/out", dir);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (input != NULL) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, input, O_RDONLY, 0);
+    }
+    char* argv[] = { (char*)shell, "-c", (char*)cmdline, NULL };
+    pid_t pid;
+
+    double start = now_s();
+    if (posix_spawn(&pid, shell, &actions, NULL, argv, environ) != 0) {
+        perror(shell);
+        exit(1);
+    }
+    waitpid(pid, NULL, 0);
+    double elapsed = now_s() - start;
+    posix_spawn_file_actions_destroy(&actions);
+
+    FILE* fp = fopen(output, "r");
+    *counted = -1;
+    if (fp != NULL) {
+        if (fscanf(fp, "%ld", counted) != 1) *counted = -1;
+        fclose(fp);
+    }
+    unlink(output);
+    return elapsed;
+}
+
+// Pipelines name the scratch directory holding the input and the tee copies with %1$s,
+// and may take a pipe capacity as %2$s
+static void bench(const char* shell, const char* name, const char* pipeline, const char* size,
+                  const char* input, long bytes, int copies) {
+    char cmdline[1024], copy[256], label[64];
+    long counted;
+    snprintf(cmdline, sizeof(cmdline), pipeline, dir, size);
+    if (size[0] != '\0') {
+        snprintf(label, sizeof(label), "%s_%s", name, size);
+        name = label;
+    }
+    double seconds = run_pipeline(shell, cmdline, input, &counted);
+
+    int ok = counted == bytes;
+    for (int i = 1; i <= copies; i++) {
+        snprintf(copy, sizeof(copy), "%s/copy%d", dir, i);
+        ok = ok && file_size(copy) == bytes;
+        unlink(copy);
+    }
+    printf("{\"shell\": \"%s\", \"bench\": \"%s\", \"mb\": %.0f, \"seconds\": %.4f, "
+           "\"mb_per_sec\": %.1f, \"ok\": %s}\n",
+           shell, name, bytes / 1e6, seconds, bytes / 1e6 / seconds, ok ? "true" : "false");
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s megabytes shell [shell...]\n", argv[0]);
+        return 1;
+    }
+    long bytes = atol(argv[1]) * 1000000L;
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    // Incompressible input, written once
+    char input[256];
+    snprintf(input, sizeof(input), "%s/input", dir);
+    FILE* fp = fopen(input, "w");
+    if (fp == NULL) {
+        perror(input);
+        return 1;
+    }
+    char* block = malloc(1 << 16);
+    unsigned long x = 88172645463325252UL;
+    for (long done = 0; done < bytes; done += 1 << 16) {
+        for (int i = 0; i < (1 << 16) / 8; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            memcpy(block + i * 8, &x, 8);
+        }
+        fwrite(block, 1, bytes - done < (1 << 16) ? bytes - done : (1 << 16), fp);
+    }
+    fclose(fp);
+    free(block);
+
+    const char* sizes[] = { "64K", "256K", "1M" };
+
+    for (int i = 2; i < argc; i++) {
+        bench(argv[i], "cat_wc", "cat %1$s/input | wc -c", "", NULL, bytes, 0);
+        bench(argv[i], "cat_chain_4", "cat %1$s/input | cat | cat | wc -c", "", NULL, bytes, 0);
+        bench(argv[i], "tee_1", "cat %1$s/input | tee %1$s/copy1 | wc -c", "", NULL, bytes, 1);
+        bench(argv[i], "tee_2", "cat %1$s/input | tee %1$s/copy1 %1$s/copy2 | wc -c", "", NULL, bytes, 2);
+        bench(argv[i], "copy_4", "tee | tee | tee | wc -c", "", input, bytes, 0);
+        for (int k = 0; i == 2 && k < 3; k++) {
+            bench(argv[i], "copy_4", "pipesize %2$s tee | tee | tee | wc -c", sizes[k], input, bytes, 0);
+        }
+    }
+
+    unlink(input);
+    rmdir(dir);
+    return 0;
+}
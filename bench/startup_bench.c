@@ -0,0 +1,55 @@
+// Startup benchmark: time from launching the shell to its first exec completing.
+//
+// Build: make build/startup_bench
+// Usage: ./build/startup_bench ./build/shell [iterations]
+//
+// Each sample starts `<shell> -c /bin/true` and waits for it. Starting /bin/true
+// directly gives the floor, and /bin/sh -c is shown for comparison.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Mean microseconds to spawn argv and wait for it
+static double time_run(char* argv[], int iters) {
+    double start = now_us();
+    for (int i = 0; i < iters; i++) {
+        pid_t pid;
+        if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0) {
+            perror(argv[0]);
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (now_us() - start) / iters;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s shell [iterations]\n", argv[0]);
+        return 1;
+    }
+    int iters = argc > 2 ? atoi(argv[2]) : 1000;
+    char* direct[] = { "/bin/true", NULL };
+    char* shell[] = { argv[1], "-c", "/bin/true", NULL };
+    char* sh[] = { "/bin/sh", "-c", "/bin/true", NULL };
+
+    double base = time_run(direct, iters);
+    double ours = time_run(shell, iters);
+    double ref = time_run(sh, iters);
+    printf("%-24s %10s %12s\n", "command", "mean (us)", "overhead (us)");
+    printf("%-24s %10.1f %12s\n", "/bin/true", base, "-");
+    printf("%-24s %10.1f %12.1f\n", "shell -c /bin/true", ours, ours - base);
+    printf("%-24s %10.1f %12.1f\n", "/bin/sh -c /bin/true", ref, ref - base);
+    return 0;
+}